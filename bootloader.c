@@ -12,141 +12,748 @@
 #define BOOTLOADER_START_ADDRESS 0x800
 #endif
 
+#define BAUD_CONFIRM_OVERFLOWS (uint16_t)((BAUD_CONFIRM_TIME/TIME_PER_TMR2_50k) + 1.0)
+#define FAST_BOOT_TICKS (uint16_t)(FAST_BOOT_TIME * (FCY / (256.0f)))
+
+/* the application record sits in the first page after the interrupt vector
+ * tables, where there is room ahead of the bootloader, so that erasing the
+ * reset vector erases the record along with it */
+#if defined(BOOT_APP_RECORD) && (BOOTLOADER_START_ADDRESS > 0x200)
+#define APP_RECORD_ADDRESS 0x200
+#define APP_RECORD_CAPABILITY CAP_APP_RECORD
+#else
+#define APP_RECORD_CAPABILITY 0
+#endif
+
+#if (MAX_PROG_SIZE % _FLASH_ROW) != 0
+#error "MAX_PROG_SIZE must be a whole number of flash rows"
+#endif
+
+/* the instructions read from flash at a time by crcRange(), txPacked(),
+ * pageBlank() and flashMatches() */
+#define READ_BLOCK_LEN 32
+
+#if defined(BOOT_STATS)
+#define STATS_CAPABILITY CAP_STATS
+#define STATS_NVM_START() (statsNvmStart = statsTimer())
+#define STATS_NVM_END(op) statsRecord(&statsNvmCount[op], &statsNvmCycles[op], \
+        &statsNvmLongest[op], statsNvmStart)
+#else
+#define STATS_CAPABILITY 0
+#define STATS_NVM_START()
+#define STATS_NVM_END(op)
+#endif
+
+#if defined(BOOT_TRACE)
+#define TRACE_CAPABILITY CAP_TRACE
+#define TRACE(event, arg) traceRecord(event, arg)
+#else
+#define TRACE_CAPABILITY 0
+#define TRACE(event, arg)
+#endif
+
+#if defined(BOOT_RX_INTERRUPT)
+#if !defined(U1RX_AIVT_ADDRESS)
+#error "BOOT_RX_INTERRUPT needs an alternate interrupt vector table, which this port doesn't have"
+#endif
+#define RX_INTERRUPT_CAPABILITY CAP_RX_INTERRUPT
+
+/* what the U1RX slot of the alternate vector table holds, the handler being
+ * in the first 64k of program memory with the rest of the bootloader */
+#define RX_VECTOR ((uint32_t)(uint16_t)(uintptr_t)_AltU1RXInterrupt)
+#else
+#define RX_INTERRUPT_CAPABILITY 0
+#endif
+
+/* the optional commands, each built in by the BOOT_ option described in
+ * bootloader.h */
+#if defined(BOOT_SEQUENCED)
+#define SEQUENCED_CAPABILITY CAP_SEQUENCED
+#else
+#define SEQUENCED_CAPABILITY 0
+#endif
+
+#if defined(BOOT_PACKED)
+#if !defined(BOOT_SEQUENCED)
+#error "BOOT_PACKED writes are sequenced, so it needs BOOT_SEQUENCED"
+#endif
+#define PACKED_CAPABILITY CAP_PACKED
+#else
+#define PACKED_CAPABILITY 0
+#endif
+
+#if defined(BOOT_SESSION)
+#if !defined(BOOT_SEQUENCED)
+#error "BOOT_SESSION frames are sequenced, so it needs BOOT_SEQUENCED"
+#endif
+#define SESSION_CAPABILITY CAP_SESSION
+#else
+#define SESSION_CAPABILITY 0
+#endif
+
+#if defined(BOOT_CRC)
+#define CRC_CAPABILITY CAP_CRC
+#else
+#define CRC_CAPABILITY 0
+#endif
+
+#if defined(BOOT_READ_RANGE)
+#define READ_RANGE_CAPABILITY CAP_READ_RANGE
+#else
+#define READ_RANGE_CAPABILITY 0
+#endif
+
+#if defined(BOOT_ERASE_RANGE)
+#define ERASE_RANGE_CAPABILITY CAP_ERASE_RANGE
+#else
+#define ERASE_RANGE_CAPABILITY 0
+#endif
+
+#if defined(BOOT_SET_BAUD)
+#define SET_BAUD_CAPABILITY CAP_SET_BAUD
+#else
+#define SET_BAUD_CAPABILITY 0
+#endif
+
+#if defined(BOOT_COBS)
+#define COBS_CAPABILITY CAP_COBS
+#else
+#define COBS_CAPABILITY 0
+#endif
+
+#if defined(BOOT_READ_SKIPPED)
+#define READ_SKIPPED_CAPABILITY CAP_READ_SKIPPED
+#else
+#define READ_SKIPPED_CAPABILITY 0
+#endif
+
+/* the code that more than one option shares */
+#if defined(BOOT_CRC) || defined(APP_RECORD_ADDRESS)
+#define CRC_RANGE
+#endif
+
+#if defined(BOOT_PACKED) || defined(BOOT_READ_RANGE)
+#define TX_PACKED
+#endif
+
+#if defined(BOOT_SET_BAUD) || defined(BOOT_COBS)
+#define LINK_CHANGES
+#endif
+
+/* each flash operation is timed between these, for BOOT_STATS and 
+ * BOOT_TRACE */
+#define NVM_START(op) do{ STATS_NVM_START(); TRACE(TRACE_NVM_START, op); }while(0)
+#define NVM_END(op) do{ STATS_NVM_END(op); TRACE(TRACE_NVM_END, op); }while(0)
+
+/* the ring and its head belong to rxDrain(), which the U1RX interrupt may 
+ * call, and the tail to the decoder; rxInterrupt is set once the interrupt 
+ * has been enabled */
+static volatile uint8_t rxRing[RX_RING_LEN];
+static volatile uint16_t rxRingHead = 0;
+static uint16_t rxRingTail = 0;
+static volatile uint16_t rxOverruns = 0, rxDropped = 0;
+static bool rxInterrupt = false;
+
+/* the replies, encoded for the wire, on their way to the transmit FIFO */
+static uint8_t txRing[TX_RING_LEN];
+static uint16_t txRingHead = 0, txRingTail = 0;
+
 static uint8_t rxBuffer[RX_BUF_LEN];
 static uint16_t rxBufferIndex = 0;
+static bool rxInFrame = false, rxEscapeNext = false, rxFrameReady = false;
+static uint8_t rxFrameStatus = STATUS_OK;
+static uint8_t rxSum1 = 0, rxSum2 = 0;
+
+#if defined(BOOT_COBS)
+/* for FRAMING_COBS, the bytes left in the block being received and whether
+ * a zero follows it, and the bytes sent since the last code byte plus one */
+static uint8_t rxCobsLeft = 0, txCobsRun = 1;
+static bool rxCobsZero = false;
+#endif
 
 static uint8_t f16_sum1 = 0, f16_sum2 = 0;
 static uint16_t t2Counter = 0;
 
+#if defined(BOOT_SEQUENCED)
+static uint16_t writeSeq = 0;
+#endif
+
+#if defined(BOOT_SESSION)
+/* the address that the next CMD_WRITE_SESSION frame is written to, and the
+ * end of the region that the session was opened in */
+static bool sessionOpen = false;
+static uint32_t sessionCursor = 0, sessionLimit = 0;
+#endif
+
+/* the page erases and row writes skipped for CMD_READ_SKIPPED */
+static uint16_t skipped[2] = {0, 0};
+
+/* the framing in use, the link settings from before the last change, and 
+ * the TMR2 overflows left for the change to be confirmed in (0 once it has
+ * been) */
+#if defined(BOOT_COBS)
+static uint8_t framing = FRAMING_ESCAPED;
+static uint8_t fallbackFraming = FRAMING_ESCAPED;
+#endif
+#if defined(BOOT_SET_BAUD)
+static uint16_t fallbackBrg = 0;
+static bool fallbackBrgh = false;
+#endif
+#if defined(LINK_CHANGES)
+static uint16_t confirmCounter = 0;
+#endif
+
+#if defined(BOOT_STATS)
+/* the counters and timings reported by CMD_READ_STATS, in statsTimer() 
+ * cycles */
+static uint16_t statsChecksums = 0, statsStale = 0;
+static uint32_t statsDecodeCycles = 0, statsTxWaitCycles = 0;
+
+static uint32_t statsNvmStart = 0;
+static uint16_t statsNvmCount[STATS_NVM_OPERATIONS];
+static uint32_t statsNvmCycles[STATS_NVM_OPERATIONS], statsNvmLongest[STATS_NVM_OPERATIONS];
+
+static uint8_t statsCmd[STATS_COMMANDS];
+static uint16_t statsCmdCount[STATS_COMMANDS], statsCommands = 0;
+static uint32_t statsCmdCycles[STATS_COMMANDS], statsCmdLongest[STATS_COMMANDS];
+#endif
+
+#if defined(BOOT_TRACE)
+/* the events waiting for CMD_READ_TRACE, oldest first */
+static TraceRecord traceRing[TRACE_LEN];
+static uint16_t traceHead = 0, traceTail = 0, traceLost = 0;
+#endif
+
+#if defined(CRC_RANGE)
+/* the CRC-32 of each value of a nibble, for crc32Words() */
+static const uint32_t crcTable[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+#endif
+
 int main(void){
+    /* the mailbox is taken before anything else, so that a request from the
+     * application never outlives the reset that it was left for */
+    bool stayResident = updateRequested();
+    
     /* initialize the peripherals from the user-supplied initialization functions */
 	initPins();
     initOsc();
     initUart();
     initTimers();
+    rxInterruptStart();
+    
+#if defined(APP_RECORD_ADDRESS)
+    /* an application that is known to be intact is started right away,
+     * unless the host makes itself known first */
+    if(!stayResident && appRecordValid() && !hostPresent())
+        exitBootloader();
+#endif
 	
-    /* wait until something is received on the serial port */
-    while(!should_abort_boot(t2Counter)){
+    /* wait until something is received on the serial port, or for as long
+     * as it takes when the application asked for the bootloader */
+    while(stayResident || !should_abort_boot(t2Counter)){
 		ClrWdt();
         
         receiveBytes();
         processReceived();
+        txPump();
         
         if(TMR2 > 50000){
             TMR2 = 0;
             t2Counter++;
+            
+#if defined(LINK_CHANGES)
+            /* a new baud rate or framing that nothing has arrived intact in
+             * in time is abandoned, so that the host can find the device 
+             * again */
+            if((confirmCounter > 0) && (--confirmCounter == 0))
+                linkFallBack();
+#endif
         }
     }
 
-    startApp(APPLICATION_START_ADDRESS);
+    exitBootloader();
     
     return 0;
 }
 
+bool appRecordValid(void){
+#if defined(APP_RECORD_ADDRESS)
+    uint32_t record[4];
+    
+    readBlock(APP_RECORD_ADDRESS, record, 4);
+    
+    /* an erased record fails the check on the length */
+    if((record[0] == 0) || (record[3] != (~record[0] & 0xffffff)))
+        return false;
+    if((APPLICATION_START_ADDRESS + (record[0] << 1)) > __PROGRAM_LENGTH)
+        return false;
+    
+    return crcRange(APPLICATION_START_ADDRESS, record[0]) == (record[1] | (record[2] << 16));
+#else
+    return false;
+#endif
+}
+
+bool updateRequested(void){
+    bool requested = (bootMailbox[0] == BOOT_MAILBOX_REQUEST)
+            && (bootMailbox[1] == (uint16_t)~BOOT_MAILBOX_REQUEST);
+    
+    bootMailbox[0] = 0;
+    bootMailbox[1] = 0;
+    
+    return requested;
+}
+
+#if defined(APP_RECORD_ADDRESS)
+bool hostPresent(void){
+#if defined(BOOT_PIN_WIRED)
+    /* should_abort_boot() also reports the boot pin, which holds the 
+     * bootloader when it is low */
+    if(!should_abort_boot(0))
+        return true;
+#endif
+    
+    TMR2 = 0;
+    while(TMR2 < FAST_BOOT_TICKS){
+        rxPoll();
+        
+        /* whatever arrived is left in the ring, since it may well be the 
+         * start of a frame */
+        if(rxPending())
+            return true;
+    }
+    
+    return false;
+}
+#endif
+
 void receiveBytes(void){
     static const uint16_t TMR1_THRESHOLD = (uint16_t)(STALE_MESSAGE_TIME * (FCY / (256.0f)));
+#if defined(BOOT_STATS)
+    uint32_t start = 0;
+    bool timed = false;
+#endif
     
-    while(U1STAbits.URXDA){
-        rxBuffer[rxBufferIndex] = U1RXREG;
-        rxBufferIndex++;
-
-        TMR1 = TMR2 = 0;
+    rxPoll();
+    
+    /* TMR2 itself is left running, so that the time for confirming a new
+     * baud rate or framing runs out however much noise arrives */
+    if(rxPending()){
+        TMR1 = 0;
         t2Counter = 0;
         T1CONbits.TON = 1;
+        
+#if defined(BOOT_STATS)
+        start = statsTimer();
+        timed = true;
+#endif
+    }
+    
+    /* once a frame is complete, leave anything further in the ring until
+     * the frame has been processed */
+    while(!rxFrameReady && rxPending()){
+        rxFrameReady = decodeByte(rxRing[rxRingTail & (RX_RING_LEN - 1)]);
+        rxRingTail++;
     }
     
+#if defined(BOOT_STATS)
+    if(timed)
+        statsDecodeCycles += statsTimer() - start;
+#endif
+    
     /* if the time since the last received has expired, then
      * turn off the timer and reset the buffer */
     if(TMR1 > TMR1_THRESHOLD){
-        uint16_t i;
         T1CONbits.TON = 0;
         TMR1 = 0;
         
+#if defined(BOOT_STATS)
+        if(rxInFrame)
+            statsStale++;
+#endif
+        rxInFrame = false;
         rxBufferIndex = 0;
-        for(i=0; i<RX_BUF_LEN; i++)   rxBuffer[i] = 0;
     }
 }
 
-void processReceived(void){
-    /* look for start and end bytes in the sequence */
-    bool startFound = false, endFound = false;
-    uint16_t indexOfStart = 0, indexOfEnd = 0;
-    uint16_t index = 0, messageIndex = 0, i;
-    uint8_t message[RX_BUF_LEN];
-    uint16_t fletcher;
-    
-    /* find the start of frame */
-    while((index < RX_BUF_LEN) && (index < rxBufferIndex)){
-        if(rxBuffer[index] == START_OF_FRAME){
-            startFound = true;
-            indexOfStart = index;
+void rxPoll(void){
+    /* once the interrupt moves the bytes, doing it here as well would race
+     * it for the head of the ring */
+    if(!rxInterrupt)
+        rxDrain();
+}
+
+bool rxPending(void){
+    return rxRingHead != rxRingTail;
+}
+
+void rxDrain(void){
+    while(U1STAbits.URXDA){
+        if((uint16_t)(rxRingHead - rxRingTail) < RX_RING_LEN){
+            rxRing[rxRingHead & (RX_RING_LEN - 1)] = U1RXREG;
+            rxRingHead++;
+        }else{
+            U1RXREG;    /* the ring is full, so the byte is lost */
+            rxDropped++;
         }
-        index++;
-        
-        if(startFound) break;
     }
     
-    /* find the end of frame */
-    while((index < RX_BUF_LEN) && (index < rxBufferIndex)){
-        if(rxBuffer[index] == END_OF_FRAME){
-            endFound = true;
-            indexOfEnd = index;
-        }
-        index++;
-        
-        if(endFound) break;
+    /* the receiver stops after an overrun until OERR is cleared, which also
+     * empties the FIFO */
+    if(U1STAbits.OERR){
+        U1STAbits.OERR = 0;
+        rxOverruns++;
+    }
+}
+
+#if defined(BOOT_RX_INTERRUPT)
+void RX_ISR _AltU1RXInterrupt(void){
+    IFS0bits.U1RXIF = 0;
+    rxDrain();
+}
+#endif
+
+void rxInterruptStart(void){
+#if defined(BOOT_RX_INTERRUPT)
+    /* the slot is blank if its page was erased and the bootloader was reset
+     * before it could program the slot again; anything else in it is the
+     * application's, and is left alone */
+    if(readAddress(U1RX_AIVT_ADDRESS) == 0xffffff)
+        writeRxVector();
+    if(readAddress(U1RX_AIVT_ADDRESS) != RX_VECTOR)
+        return;
+    
+    IFS0bits.U1RXIF = 0;
+    INTCON2bits.ALTIVT = 1;
+    IEC0bits.U1RXIE = 1;
+    rxInterrupt = true;
+#endif
+}
+
+void writeRxVector(void){
+#if defined(BOOT_RX_INTERRUPT)
+    uint32_t vector[2] = {0xffffff, 0xffffff};
+    
+    /* the other instruction of the double word is left erased */
+    vector[(U1RX_AIVT_ADDRESS >> 1) & 1] = RX_VECTOR;
+    
+    NVM_START(STATS_NVM_DOUBLE_WORD);
+    doubleWordWrite(U1RX_AIVT_ADDRESS & ~(uint32_t)3, vector);
+    NVM_END(STATS_NVM_DOUBLE_WORD);
+#endif
+}
+
+void exitBootloader(void){
+#if defined(BOOT_RX_INTERRUPT)
+    /* the application gets the interrupt controller as it was at reset */
+    IEC0bits.U1RXIE = 0;
+    IFS0bits.U1RXIF = 0;
+    INTCON2bits.ALTIVT = 0;
+    rxInterrupt = false;
+#endif
+    
+    txFlush();
+    startApp(APPLICATION_START_ADDRESS);
+}
+
+void nvmWait(void){
+    while(NVMCONbits.WR){
+        rxPoll();
+        txPump();
+    }
+    
+    rxPoll();
+}
+
+bool decodeByte(uint8_t byte){
+#if defined(BOOT_COBS)
+    if(framing == FRAMING_COBS)
+        return decodeCobs(byte);
+#endif
+    
+    /* a start byte always begins a new frame, discarding any partial one */
+    if(byte == START_OF_FRAME){
+        rxStartFrame();
+        return false;
+    }
+    
+    if(!rxInFrame)
+        return false;
+    
+    if(byte == END_OF_FRAME)
+        return rxEndFrame();
+    
+    /* remove escape characters as the bytes arrive */
+    if(rxEscapeNext){
+        byte ^= ESC_XOR;
+        rxEscapeNext = false;
+    }else if(byte == ESC){
+        rxEscapeNext = true;
+        return false;
     }
     
-    if(startFound && endFound){
-        bool escapeNext = false;
-        index = indexOfStart;
-        messageIndex = 0;
+    rxAppend(byte);
+    return false;
+}
+
+#if defined(BOOT_COBS)
+bool decodeCobs(uint8_t byte){
+    /* the zero ends the frame, and whatever follows it begins the next */
+    if(byte == 0){
+        if(!rxInFrame)
+            return false;
         
-        /* read the message out, removing escape characters as necessary */
-        for(index=indexOfStart+1; index<indexOfEnd; index++){
-            if(!escapeNext){
-                if(rxBuffer[index] == ESC){
-                    escapeNext = true;
-                }else{
-                    message[messageIndex] = rxBuffer[index];
-                    messageIndex++;
-                }
-            }else{
-                message[messageIndex] = rxBuffer[index] ^ ESC_XOR;
-                messageIndex++;
-                escapeNext = false;
-            }
-        }
+        /* a block that the zero cut short leaves bytes missing */
+        if(rxCobsLeft != 0)
+            rxFrameStatus = STATUS_LENGTH;
         
-        /* read the fletcher number from the message */
-        fletcher = (uint16_t)message[messageIndex - 2] 
-                + ((uint16_t)message[messageIndex - 1] << 8);
+        return rxEndFrame();
+    }
+    
+    if(!rxInFrame){
+        rxStartFrame();
+        rxCobsLeft = 0;
+        rxCobsZero = false;
+    }
+    
+    if(rxCobsLeft != 0){
+        rxCobsLeft--;
+        rxAppend(byte);
+        return false;
+    }
+    
+    /* a code byte, which shows that the block before it wasn't the last, 
+     * so its zero is added now */
+    if(rxCobsZero)
+        rxAppend(0);
+    
+    rxCobsLeft = byte - 1;
+    rxCobsZero = (byte != 0xff);
+    return false;
+}
+#endif
+
+void rxStartFrame(void){
+    TRACE(TRACE_FRAME_START, 0);
+    
+    rxInFrame = true;
+    rxEscapeNext = false;
+    rxFrameStatus = STATUS_OK;
+    rxBufferIndex = 0;
+    rxSum1 = rxSum2 = 0;
+}
+
+void rxAppend(uint8_t byte){
+    /* the rest of a frame that does not fit is discarded, and the frame is
+     * reported once it ends */
+    if(rxBufferIndex >= RX_BUF_LEN){
+        rxFrameStatus = STATUS_LENGTH;
+        return;
+    }
+    
+    /* the last two bytes of the frame are the checksum itself, so each byte
+     * is accumulated once two more have arrived behind it */
+    if(rxBufferIndex >= 2){
+        rxSum1 += rxBuffer[rxBufferIndex - 2];
+        rxSum2 += rxSum1;
+    }
+    
+    rxBuffer[rxBufferIndex] = byte;
+    rxBufferIndex++;
+}
+
+bool rxEndFrame(void){
+    uint16_t fletcher;
+    
+    TRACE(TRACE_FRAME_END, rxBufferIndex);
+    
+    rxInFrame = false;
+    
+    /* the length, command, and checksum must all be present */
+    if(rxBufferIndex < 5)
+        rxFrameStatus = STATUS_LENGTH;
+    
+    if(rxFrameStatus != STATUS_OK)
+        return true;
+    
+    /* read the fletcher number from the message */
+    fletcher = (uint16_t)rxBuffer[rxBufferIndex - 2] 
+            + ((uint16_t)rxBuffer[rxBufferIndex - 1] << 8);
+    
+    if(fletcher != (((uint16_t)rxSum2 << 8) | rxSum1))
+        rxFrameStatus = STATUS_CHECKSUM;
+    
+    return true;
+}
+
+#if defined(BOOT_SET_BAUD)
+void uartSetBrg(uint16_t brg, bool highSpeed){
+    txFlush();
+    
+    U1MODEbits.UARTEN = 0;
+    U1MODEbits.BRGH = highSpeed;
+    U1BRG = brg;
+    U1MODEbits.UARTEN = 1;
+    U1STAbits.UTXEN = 1;
+    
+    /* anything partly received was at the old rate */
+    rxInFrame = false;
+    rxBufferIndex = 0;
+}
+#endif
+
+#if defined(LINK_CHANGES)
+void linkChanging(void){
+#if defined(BOOT_SET_BAUD)
+    fallbackBrg = U1BRG;
+    fallbackBrgh = U1MODEbits.BRGH;
+#endif
+#if defined(BOOT_COBS)
+    fallbackFraming = framing;
+#endif
+    confirmCounter = BAUD_CONFIRM_OVERFLOWS;
+}
+
+void linkFallBack(void){
+#if defined(BOOT_SET_BAUD)
+    uartSetBrg(fallbackBrg, fallbackBrgh);
+#endif
+#if defined(BOOT_COBS)
+    framing = fallbackFraming;
+#endif
+}
+#endif
+
+void processReceived(void){
+#if defined(BOOT_STATS)
+    uint32_t start;
+#endif
+    
+    if(!rxFrameReady)
+        return;
+    
+#if defined(BOOT_STATS)
+    start = statsTimer();
+#endif
+    TRACE(TRACE_DECODE_DONE, rxBuffer[2] | ((uint16_t)rxFrameStatus << 8));
+    
+    /* the length must account for everything between the command and the
+     * checksum */
+    if((rxFrameStatus == STATUS_OK) 
+            && ((uint16_t)rxBuffer[0] + ((uint16_t)rxBuffer[1] << 8) + 5 != rxBufferIndex)){
+        rxFrameStatus = STATUS_LENGTH;
+    }
+    
+    if(rxFrameStatus == STATUS_OK){
+#if defined(LINK_CHANGES)
+        /* any intact frame confirms new link settings */
+        confirmCounter = 0;
+#endif
+        processCommand(rxBuffer);
         
-        /* if they match, then process the message */
-        if(fletcher == fletcher16(message, messageIndex - 2)){
-            processCommand(message);
-        }
+#if defined(BOOT_STATS)
+        statsCommand(rxBuffer[2], start);
+#endif
+    }else{
+#if defined(BOOT_STATS)
+        if(rxFrameStatus == STATUS_CHECKSUM)
+            statsChecksums++;
+#endif
         
-        /* stop the timer, clear the buffer */
-        T1CONbits.TON = 0;
-        TMR1 = 0;
-        rxBufferIndex = 0;
-        for(i=0; i<RX_BUF_LEN; i++)   rxBuffer[i] = 0;
+        /* the command may be corrupt, but it is the best guess there is; a
+         * frame too short to carry one would leave the last frame's there */
+        txStatus((rxBufferIndex > 2) ? rxBuffer[2] : CMD_STATUS, rxFrameStatus);
     }
+    TRACE(TRACE_COMMAND_END, rxBuffer[2]);
+    
+    /* stop the timer, reset the buffer */
+    T1CONbits.TON = 0;
+    TMR1 = 0;
+    rxFrameReady = false;
+    rxBufferIndex = 0;
 }
 
 void processCommand(uint8_t* data){
     uint16_t i;
     
     /* length is the length of the data block only, not including the command */
+    uint16_t length = (uint16_t)data[0] + ((uint16_t)data[1] << 8);
     uint8_t cmd = data[2];
     uint32_t address;
     uint16_t word;
+    uint16_t rxErrors[2];
     uint32_t longWord;
-    uint32_t progData[MAX_PROG_SIZE + 1] = {0};
+    uint32_t progData[MAX_PROG_SIZE + 1];
+    uint8_t status = STATUS_OK;
+#if defined(BOOT_DESCRIPTOR)
+    uint8_t* bytes;
+#endif
+#if defined(BOOT_ERASE_RANGE)
+    uint16_t pages[2];
+#endif
+#if defined(BOOT_CRC) || defined(BOOT_READ_RANGE) || defined(BOOT_SET_BAUD) \
+        || defined(APP_RECORD_ADDRESS)
+    uint32_t count;
+#endif
+#if defined(BOOT_SEQUENCED)
+    uint8_t seqCmd = cmd;
+    bool sequenced = false;
+#endif
     
     char strVersion[16] = VERSION_STRING;
     char strPlatform[20] = PLATFORM_STRING;
+    
+    if(length < commandLength(cmd)){
+        txStatus(cmd, STATUS_LENGTH);
+        return;
+    }
+    
+#if defined(BOOT_SEQUENCED)
+    /* a sequenced write carries its sequence number ahead of the address;
+     * frames are only written in order, and anything else is answered with
+     * the sequence number that is expected next */
+    if((cmd == CMD_WRITE_ROW_SEQ) || (cmd == CMD_WRITE_MAX_SEQ)
+#if defined(BOOT_PACKED)
+            || (cmd == CMD_WRITE_ROW_PACKED) || (cmd == CMD_WRITE_MAX_PACKED)
+#endif
+#if defined(BOOT_SESSION)
+            || (cmd == CMD_WRITE_SESSION)
+#endif
+            ){
+        int16_t ahead = (int16_t)(((uint16_t)data[3] + ((uint16_t)data[4] << 8)) - writeSeq);
+        
+#if defined(BOOT_SESSION)
+        /* a gap ends a session, since nothing after it can be placed, and
+         * nothing can be placed outside of one either */
+        if((cmd == CMD_WRITE_SESSION) && ((ahead > 0) || !sessionOpen)){
+            sessionOpen = false;
+            txWriteReply(seqCmd, STATUS_OUT_OF_ORDER);
+            return;
+        }
+#endif
+        
+        if(ahead != 0){
+            /* a frame that was already written is acknowledged again, since
+             * the acknowledgment may be what was lost */
+            txWriteReply(seqCmd, (ahead < 0) ? STATUS_OK : STATUS_OUT_OF_ORDER);
+            return;
+        }
+        
+        /* the rest of the frame is the same as the unsequenced write */
+        sequenced = true;
+        data += 2;
+        length -= 2;
+        if(cmd == CMD_WRITE_ROW_SEQ)
+            cmd = CMD_WRITE_ROW;
+        else if(cmd == CMD_WRITE_MAX_SEQ)
+            cmd = CMD_WRITE_MAX_PROG_SIZE;
+    }
+#endif
 
     switch(cmd){
         case CMD_READ_PLATFORM:
@@ -187,6 +794,55 @@ void processCommand(uint8_t* data){
             txArray16bit(cmd, &word, 1);
             break;
             
+        case CMD_READ_RX_ERRORS:
+            rxErrors[0] = rxOverruns;
+            rxErrors[1] = rxDropped;
+            txArray16bit(cmd, rxErrors, 2);
+            break;
+            
+#if defined(BOOT_READ_SKIPPED)
+        case CMD_READ_SKIPPED:
+            txArray16bit(cmd, skipped, 2);
+            break;
+#endif
+            
+#if defined(BOOT_DESCRIPTOR)
+        case CMD_READ_DESCRIPTOR:
+            /* laid out as described with DESCRIPTOR_VERSION */
+            bytes = packLittle((uint8_t*)progData, DESCRIPTOR_VERSION, 1);
+            bytes = packLittle(bytes, _FLASH_ROW, 2);
+            bytes = packLittle(bytes, _FLASH_PAGE, 2);
+            bytes = packLittle(bytes, __PROGRAM_LENGTH, 4);
+            bytes = packLittle(bytes, MAX_PROG_SIZE, 2);
+            bytes = packLittle(bytes, APPLICATION_START_ADDRESS, 4);
+            bytes = packLittle(bytes, BOOTLOADER_START_ADDRESS, 4);
+            bytes = packLittle(bytes, RX_BUF_LEN, 2);
+            bytes = packLittle(bytes, CAPABILITIES | SEQUENCED_CAPABILITY | PACKED_CAPABILITY
+                    | SESSION_CAPABILITY | CRC_CAPABILITY | READ_RANGE_CAPABILITY
+                    | ERASE_RANGE_CAPABILITY | SET_BAUD_CAPABILITY | COBS_CAPABILITY
+                    | READ_SKIPPED_CAPABILITY | APP_RECORD_CAPABILITY | STATS_CAPABILITY | TRACE_CAPABILITY
+                    | RX_INTERRUPT_CAPABILITY, 4);
+            for(i=0; i<sizeof(strVersion); i++)
+                *bytes++ = (uint8_t)strVersion[i];
+            for(i=0; i<sizeof(strPlatform); i++)
+                *bytes++ = (uint8_t)strPlatform[i];
+            
+            txBytes(cmd, (uint8_t*)progData, DESCRIPTOR_LEN);
+            break;
+#endif
+            
+#if defined(BOOT_STATS)
+        case CMD_READ_STATS:
+            txBytes(cmd, (uint8_t*)progData, statsPack((uint8_t*)progData));
+            break;
+#endif
+            
+#if defined(BOOT_TRACE)
+        case CMD_READ_TRACE:
+            txTrace(cmd);
+            break;
+#endif
+            
         case CMD_ERASE_PAGE:
             /* should correspond to a border */
             address = (uint32_t)data[3] 
@@ -195,24 +851,55 @@ void processCommand(uint8_t* data){
                     + ((uint32_t)data[6] << 24);
             
             /* do not allow the bootloader to be erased */
-            if((address >= BOOTLOADER_START_ADDRESS) && (address < APPLICATION_START_ADDRESS))
+            if((address >= BOOTLOADER_START_ADDRESS) && (address < APPLICATION_START_ADDRESS)){
+                status = STATUS_PROTECTED;
                 break;
+            }
             
-			eraseByAddress(address);
+            erasePage(address);
+            break;
             
-            /* re-initialize the bootloader start address */
-            if(address == 0){
-                address = 0x00000000;
-                
-                /* this is the GOTO BOOTLOADER instruction */
-                progData[0] = 0x040000 + BOOTLOADER_START_ADDRESS;
-                progData[1] = 0x000000;
+#if defined(BOOT_ERASE_RANGE)
+        case CMD_ERASE_RANGE:
+            address = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            longWord = (uint32_t)data[7] 
+                    + ((uint32_t)data[8] << 8)
+                    + ((uint32_t)data[9] << 16)
+                    + ((uint32_t)data[10] << 24);
+            
+            if((address >= longWord) || (longWord > __PROGRAM_LENGTH)){
+                status = STATUS_LENGTH;
+                break;
+            }
+            
+#if defined(CONFIG_PAGE_ADDRESS)
+            /* the page with the configuration words is only ever erased on 
+             * its own, with CMD_ERASE_PAGE */
+            if(longWord > CONFIG_PAGE_ADDRESS)
+                longWord = CONFIG_PAGE_ADDRESS;
+#endif
+            
+            /* every page that the range touches is erased, apart from the
+             * bootloader's own, counting those erased and those skipped */
+            address -= address % (_FLASH_PAGE << 1);
+            pages[0] = pages[1] = 0;
+            for(; address < longWord; address += (_FLASH_PAGE << 1)){
+                ClrWdt();
+                if((address >= BOOTLOADER_START_ADDRESS) && (address < APPLICATION_START_ADDRESS))
+                    continue;
                 
-                /* write the data */
-                doubleWordWrite(address, progData);
+                if(erasePage(address))
+                    pages[0]++;
+                else
+                    pages[1]++;
             }
             
+            txArray16bit(cmd, pages, 2);
             break;
+#endif
             
         case CMD_READ_ADDR:
             address = (uint32_t)data[3] 
@@ -232,94 +919,818 @@ void processCommand(uint8_t* data){
                     + ((uint32_t)data[6] << 24);
             
             progData[0] = address;
-            
-            for(i=0; i<MAX_PROG_SIZE; i++){
-                progData[i+1] = readAddress((address + (i << 1)));
-            }
+            readBlock(address, &progData[1], MAX_PROG_SIZE);
             
             txArray32bit(cmd, progData, MAX_PROG_SIZE + 1);
             
             break;
             
-        case CMD_WRITE_ROW:
+#if defined(BOOT_PACKED)
+        case CMD_READ_MAX_PACKED:
             address = (uint32_t)data[3] 
                     + ((uint32_t)data[4] << 8)
                     + ((uint32_t)data[5] << 16)
                     + ((uint32_t)data[6] << 24);
             
-            for(i=0; i<_FLASH_ROW; i++){
-                progData[i] = (uint32_t)data[i * 4 + 7] 
-                    + ((uint32_t)data[i * 4 + 8] << 8)
-                    + ((uint32_t)data[i * 4 + 9] << 16)
-                    + ((uint32_t)data[i * 4 + 10] << 24);
-            }
-            
-            /* do not allow the bootloader to be overwritten */
-            if((word >= BOOTLOADER_START_ADDRESS) && (word < APPLICATION_START_ADDRESS))
+            txPacked(cmd, address, MAX_PROG_SIZE);
+            break;
+#endif
+            
+#if defined(BOOT_READ_RANGE)
+        case CMD_READ_RANGE:
+            address = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            count = (uint32_t)data[7] 
+                    + ((uint32_t)data[8] << 8)
+                    + ((uint32_t)data[9] << 16)
+                    + ((uint32_t)data[10] << 24);
+            
+            /* the range must lie within program memory, or a bad count would
+             * stream unimplemented memory for minutes */
+            if((address >= __PROGRAM_LENGTH) || (count > ((__PROGRAM_LENGTH - address) >> 1))){
+                status = STATUS_LENGTH;
+                break;
+            }
+            
+            /* the frames go out back to back, and an empty range still gets
+             * one so that the host isn't left waiting */
+            do{
+                word = (count < MAX_PROG_SIZE) ? (uint16_t)count : MAX_PROG_SIZE;
+                txPacked(cmd, address, word);
+                
+                address += (uint32_t)word << 1;
+                count -= word;
+                ClrWdt();
+            }while(count > 0);
+            break;
+#endif
+            
+#if defined(BOOT_CRC)
+        case CMD_READ_CRC:
+            address = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            count = (uint32_t)data[7] 
+                    + ((uint32_t)data[8] << 8)
+                    + ((uint32_t)data[9] << 16)
+                    + ((uint32_t)data[10] << 24);
+            
+            /* the range must lie within program memory, or the CRC
+             * would keep the device busy for as long as the count says */
+            if((address >= __PROGRAM_LENGTH) || (count > ((__PROGRAM_LENGTH - address) >> 1))){
+                status = STATUS_LENGTH;
                 break;
+            }
+            
+            progData[0] = address;
+            progData[1] = count;
+            progData[2] = crcRange(address, count);
+            txArray32bit(cmd, progData, 3);
+            break;
+#endif
             
-            /* do not allow the reset vector to be changed by the application */
-            if(word < __IVT_BASE)
+        case CMD_WRITE_ROW:
+#if defined(BOOT_PACKED)
+        case CMD_WRITE_ROW_PACKED:
+#endif
+            address = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            
+            unpackWords(progData, &data[7], _FLASH_ROW, (cmd == CMD_WRITE_ROW_PACKED) ? 3 : 4);
+            
+            /* do not allow the bootloader to be overwritten */
+            if((address >= BOOTLOADER_START_ADDRESS) && (address < APPLICATION_START_ADDRESS)){
+                status = STATUS_PROTECTED;
                 break;
+            }
+            
+            /* the zero address should always go to the bootloader */
+            if(address == 0){
+                progData[0] = 0x040000 | BOOTLOADER_START_ADDRESS;
+                progData[1] = 0x000000;
+            }
 
-			writeRow(address, progData);
+            programRow(address, progData);
             break;
             
         case CMD_WRITE_MAX_PROG_SIZE:
+#if defined(BOOT_PACKED)
+        case CMD_WRITE_MAX_PACKED:
+#endif
             address = (uint32_t)data[3] 
                     + ((uint32_t)data[4] << 8)
                     + ((uint32_t)data[5] << 16)
                     + ((uint32_t)data[6] << 24);
             
+            /* do not allow the bootloader to be overwritten */
+            if((address < APPLICATION_START_ADDRESS) 
+                    && ((address + (MAX_PROG_SIZE << 1)) > BOOTLOADER_START_ADDRESS)){
+                status = STATUS_PROTECTED;
+                break;
+            }
+            
             /* fill the progData array */
-            for(i=0; i<MAX_PROG_SIZE; i++){
-                progData[i] = (uint32_t)data[7 + (i * 4)]
-                        + ((uint32_t)data[8 + (i * 4)] << 8)
-                        + ((uint32_t)data[9 + (i * 4)] << 16)
-                        + ((uint32_t)data[10 + (i * 4)] << 24);
-                
-                /* the zero address should always go to the bootloader */
-                if(address == 0){
-                    if(i == 0){
-                        progData[i] = 0x040000 | BOOTLOADER_START_ADDRESS;
-                    }else if(i == 1){
-                        progData[i] = 0x000000;
-                    }
-                }
+            unpackWords(progData, &data[7], MAX_PROG_SIZE, (cmd == CMD_WRITE_MAX_PACKED) ? 3 : 4);
+            
+            /* the zero address should always go to the bootloader */
+            if(address == 0){
+                progData[0] = 0x040000 | BOOTLOADER_START_ADDRESS;
+                progData[1] = 0x000000;
             }
-            writeRow(address, progData);
-
+            
+            for(i=0; i<MAX_PROG_SIZE; i+=_FLASH_ROW)
+                programRow(address + (i << 1), &progData[i]);
+            break;
+            
+#if defined(BOOT_SEQUENCED)
+        case CMD_WRITE_SEQ_RESET:
+            writeSeq = 0;
+#if defined(BOOT_SESSION)
+            sessionOpen = false;
+#endif
+            txWriteReply(cmd, STATUS_OK);
+            break;
+#endif
+            
+#if defined(BOOT_SESSION)
+        case CMD_WRITE_SESSION_OPEN:
+            address = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            
+            /* frames are written a whole MAX_PROG_SIZE at a time, so one 
+             * that started part way through would spill into the next */
+            if((address % (MAX_PROG_SIZE << 1)) != 0){
+                status = STATUS_LENGTH;
+                break;
+            }
+            
+            /* the address is checked once here, and each frame then only 
+             * has to stay short of the bootloader or the end of flash */
+            if((address >= BOOTLOADER_START_ADDRESS) && (address < APPLICATION_START_ADDRESS)){
+                status = STATUS_PROTECTED;
+                break;
+            }
+            
+            sessionLimit = (address < BOOTLOADER_START_ADDRESS) 
+                    ? BOOTLOADER_START_ADDRESS : __PROGRAM_LENGTH;
+            sessionCursor = address;
+            sessionOpen = true;
+            writeSeq = 0;
+            txWriteReply(cmd, STATUS_OK);
+            break;
+            
+        case CMD_WRITE_SESSION:
+            if((sessionCursor + (MAX_PROG_SIZE << 1)) > sessionLimit){
+                sessionOpen = false;
+                status = STATUS_PROTECTED;
+                break;
+            }
+            
+            unpackWords(progData, &data[3], MAX_PROG_SIZE, 3);
+            
+            /* the zero address should always go to the bootloader */
+            if(sessionCursor == 0){
+                progData[0] = 0x040000 | BOOTLOADER_START_ADDRESS;
+                progData[1] = 0x000000;
+            }
+            
+            for(i=0; i<MAX_PROG_SIZE; i+=_FLASH_ROW)
+                programRow(sessionCursor + (i << 1), &progData[i]);
+            
+            sessionCursor += (uint32_t)MAX_PROG_SIZE << 1;
+            break;
+            
+        case CMD_WRITE_SESSION_CLOSE:
+            sessionOpen = false;
+            txWriteReply(cmd, STATUS_OK);
+            break;
+#endif
+            
+#if defined(BOOT_SET_BAUD)
+        case CMD_SET_BAUD:
+            longWord = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            
+            /* the divide-by-4 (BRGH) mode reaches the fastest rates, with the
+             * divisor rounded to the nearest */
+            count = (longWord == 0) ? 0 : (((FCY / 4) + (longWord / 2)) / longWord);
+            if((count == 0) || (count > 0x10000)){
+                status = STATUS_BAUD_RATE;
+                break;
+            }
+            
+            progData[0] = (FCY / 4) / count;
+            if(((progData[0] > longWord) ? (progData[0] - longWord) : (longWord - progData[0]))
+                    > (longWord / 50)){
+                status = STATUS_BAUD_RATE;
+                break;
+            }
+            
+            /* the reply goes out at the old rate with the rate that will
+             * actually be used, and the host has to send an intact frame at
+             * the new one before the confirmation time runs out */
+            txArray32bit(cmd, progData, 1);
+            linkChanging();
+            uartSetBrg((uint16_t)(count - 1), true);
+            break;
+#endif
+            
+#if defined(BOOT_COBS)
+        case CMD_SET_FRAMING:
+            if(data[3] > FRAMING_COBS){
+                status = STATUS_FRAMING;
+                break;
+            }
+            
+            /* as for CMD_SET_BAUD, the reply goes out in the old framing, 
+             * and the new one is abandoned unless an intact frame arrives
+             * in it in time */
+            txBytes(cmd, &data[3], 1);
+            linkChanging();
+            framing = data[3];
+            break;
+#endif
+            
+#if defined(APP_RECORD_ADDRESS)
+        case CMD_WRITE_APP_RECORD:
+            count = (uint32_t)data[3] 
+                    + ((uint32_t)data[4] << 8)
+                    + ((uint32_t)data[5] << 16)
+                    + ((uint32_t)data[6] << 24);
+            longWord = (uint32_t)data[7] 
+                    + ((uint32_t)data[8] << 8)
+                    + ((uint32_t)data[9] << 16)
+                    + ((uint32_t)data[10] << 24);
+            
+            /* the record can only be programmed once the first page has
+             * been erased */
+            readBlock(APP_RECORD_ADDRESS, progData, 4);
+            for(i=0; i<4; i++){
+                if(progData[i] != 0xffffff)
+                    status = STATUS_PROTECTED;
+            }
+            if(status != STATUS_OK)
+                break;
+            
+            /* and only for an application that matches it */
+            if((count == 0) || (count > 0xffffff)
+                    || ((APPLICATION_START_ADDRESS + (count << 1)) > __PROGRAM_LENGTH)
+                    || (crcRange(APPLICATION_START_ADDRESS, count) != longWord)){
+                status = STATUS_VERIFY;
+                break;
+            }
+            
+            progData[0] = count;
+            progData[1] = longWord & 0xffff;
+            progData[2] = longWord >> 16;
+            progData[3] = ~count & 0xffffff;
+            NVM_START(STATS_NVM_DOUBLE_WORD);
+            doubleWordWrite(APP_RECORD_ADDRESS, &progData[0]);
+            NVM_END(STATS_NVM_DOUBLE_WORD);
+            NVM_START(STATS_NVM_DOUBLE_WORD);
+            doubleWordWrite(APP_RECORD_ADDRESS + 4, &progData[2]);
+            NVM_END(STATS_NVM_DOUBLE_WORD);
+            
+            txArray32bit(cmd, progData, 4);
             break;
+#endif
             
         case CMD_START_APP:
-            startApp(APPLICATION_START_ADDRESS);
+            exitBootloader();
             break;
             
         default:
-        {}
+            status = STATUS_UNKNOWN_COMMAND;
     }
+    
+#if defined(BOOT_SEQUENCED)
+    /* a sequenced write is consumed even when it is refused, so that the
+     * loader moves past it */
+    if(sequenced){
+        writeSeq++;
+        txWriteReply(seqCmd, status);
+        return;
+    }
+#endif
+    
+    if(status != STATUS_OK)
+        txStatus(cmd, status);
 }
 
+uint16_t commandLength(uint8_t cmd){
+    switch(cmd){
+        case CMD_ERASE_PAGE:
+        case CMD_READ_ADDR:
+        case CMD_READ_MAX:
+            return 4;
+            
+#if defined(BOOT_PACKED)
+        case CMD_READ_MAX_PACKED:
+            return 4;
+#endif
+            
+#if defined(BOOT_ERASE_RANGE)
+        case CMD_ERASE_RANGE:
+            return 4 + 4;
+#endif
+            
+#if defined(BOOT_CRC)
+        case CMD_READ_CRC:
+            return 4 + 4;
+#endif
+            
+#if defined(BOOT_READ_RANGE)
+        case CMD_READ_RANGE:
+            return 4 + 4;
+#endif
+            
+#if defined(BOOT_SET_BAUD)
+        case CMD_SET_BAUD:
+            return 4;
+#endif
+            
+#if defined(BOOT_COBS)
+        case CMD_SET_FRAMING:
+            return 1;
+#endif
+            
+#if defined(APP_RECORD_ADDRESS)
+        case CMD_WRITE_APP_RECORD:
+            return 4 + 4;
+#endif
+            
+        case CMD_WRITE_ROW:
+            return 4 + (_FLASH_ROW * 4);
+            
+        case CMD_WRITE_MAX_PROG_SIZE:
+            return 4 + (MAX_PROG_SIZE * 4);
+            
+#if defined(BOOT_SEQUENCED)
+        case CMD_WRITE_ROW_SEQ:
+            return 2 + 4 + (_FLASH_ROW * 4);
+            
+        case CMD_WRITE_MAX_SEQ:
+            return 2 + 4 + (MAX_PROG_SIZE * 4);
+#endif
+            
+#if defined(BOOT_PACKED)
+        case CMD_WRITE_ROW_PACKED:
+            return 2 + 4 + (_FLASH_ROW * 3);
+            
+        case CMD_WRITE_MAX_PACKED:
+            return 2 + 4 + (MAX_PROG_SIZE * 3);
+#endif
+            
+#if defined(BOOT_SESSION)
+        case CMD_WRITE_SESSION_OPEN:
+            return 4;
+            
+        case CMD_WRITE_SESSION:
+            return 2 + (MAX_PROG_SIZE * 3);
+#endif
+            
+        default:
+            return 0;
+    }
+}
+
+bool erasePage(uint32_t address){
+    uint32_t resetVector[2];
+    bool erased;
+    
+    /* the whole page is erased wherever the address falls in it, so the
+     * checks below have to look at the page from its start */
+    address -= address % (_FLASH_PAGE << 1);
+    erased = !pageBlank(address);
+    
+#if defined(BOOT_RX_INTERRUPT)
+    /* the U1RX slot of the alternate vector table is blank from the erase
+     * until it is written again, so receive by polling in between */
+    bool rxSlot = (address == (U1RX_AIVT_ADDRESS & ~((uint32_t)(_FLASH_PAGE << 1) - 1)));
+    
+    if(rxSlot){
+        IEC0bits.U1RXIE = 0;
+        rxInterrupt = false;
+    }
+#endif
+    
+    /* reading the page back costs far less than an erase, which stalls the
+     * CPU and the receiver with it */
+    if(erased){
+        NVM_START(STATS_NVM_ERASE);
+        eraseByAddress(address);
+        NVM_END(STATS_NVM_ERASE);
+    }else{
+        skipped[0]++;
+    }
+    
+    /* re-initialize the bootloader start address */
+    if(address == 0){
+        /* this is the GOTO BOOTLOADER instruction */
+        resetVector[0] = 0x040000 + BOOTLOADER_START_ADDRESS;
+        resetVector[1] = 0x000000;
+        
+        /* write the data */
+        NVM_START(STATS_NVM_DOUBLE_WORD);
+        doubleWordWrite(address, resetVector);
+        NVM_END(STATS_NVM_DOUBLE_WORD);
+    }
+    
+#if defined(BOOT_RX_INTERRUPT)
+    if(rxSlot){
+        writeRxVector();
+        rxInterruptStart();
+    }
+#endif
+    
+    return erased;
+}
+
+void programRow(uint32_t address, uint32_t* words){
+#if defined(BOOT_RX_INTERRUPT)
+    /* the U1RX slot of the alternate vector table stays the bootloader's */
+    if((U1RX_AIVT_ADDRESS >= address) && (U1RX_AIVT_ADDRESS < address + (_FLASH_ROW << 1)))
+        words[(U1RX_AIVT_ADDRESS - address) >> 1] = RX_VECTOR;
+#endif
+    
+    /* a row that already holds the instructions, such as one left blank 
+     * in the image over a blank page, or one that a host resent, isn't
+     * programmed again */
+    if(flashMatches(address, words, _FLASH_ROW)){
+        skipped[1]++;
+        return;
+    }
+    
+    NVM_START(STATS_NVM_ROW);
+    writeRow(address, words);
+    NVM_END(STATS_NVM_ROW);
+}
+
+bool flashMatches(uint32_t address, uint32_t* words, uint16_t count){
+#if defined(BOOT_READ_SKIPPED)
+    uint32_t block[READ_BLOCK_LEN];
+    uint16_t i, length;
+    
+    while(count > 0){
+        length = (count < READ_BLOCK_LEN) ? count : READ_BLOCK_LEN;
+        readBlock(address, block, length);
+        
+        for(i=0; i<length; i++){
+            if(block[i] != (words[i] & 0xffffff))
+                return false;
+        }
+        
+        address += (uint32_t)length << 1;
+        words += length;
+        count -= length;
+    }
+    
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool pageBlank(uint32_t address){
+#if defined(BOOT_READ_SKIPPED)
+    uint32_t block[READ_BLOCK_LEN];
+    uint16_t i, j;
+    
+    for(i=0; i<_FLASH_PAGE; i+=READ_BLOCK_LEN){
+        readBlock(address + ((uint32_t)i << 1), block, READ_BLOCK_LEN);
+        
+        for(j=0; j<READ_BLOCK_LEN; j++){
+            if(block[j] != 0xffffff)
+                return false;
+        }
+    }
+    
+    return true;
+#else
+    return false;
+#endif
+}
+
+void unpackWords(uint32_t* words, uint8_t* bytes, uint16_t count, uint8_t width){
+    uint16_t i;
+    
+    for(i=0; i<count; i++){
+        words[i] = (uint32_t)bytes[0]
+                + ((uint32_t)bytes[1] << 8)
+                + ((uint32_t)bytes[2] << 16);
+        
+        /* the upper byte of a 4-byte word is phantom, so it is ignored */
+        bytes += width;
+    }
+}
+
+uint8_t* packLittle(uint8_t* dest, uint32_t value, uint8_t width){
+    while(width--){
+        *dest++ = (uint8_t)(value & 0xff);
+        value >>= 8;
+    }
+    
+    return dest;
+}
+
+#if defined(CRC_RANGE)
+uint32_t crc32Words(uint32_t crc, uint32_t* words, uint16_t count){
+    uint8_t* bytes = (uint8_t*)words;
+    uint16_t i;
+    uint8_t j;
+    
+    /* the words are little-endian, so the phantom byte is the fourth */
+    for(i=0; i<count; i++){
+        for(j=0; j<3; j++){
+            crc ^= bytes[j];
+            crc = (crc >> 4) ^ crcTable[crc & 0x0f];
+            crc = (crc >> 4) ^ crcTable[crc & 0x0f];
+        }
+        bytes += 4;
+    }
+    
+    return crc;
+}
+
+uint32_t crcRange(uint32_t address, uint32_t count){
+    uint32_t block[READ_BLOCK_LEN];
+    uint32_t crc = 0xffffffff;
+    uint16_t length;
+    
+    while(count > 0){
+        length = (count < READ_BLOCK_LEN) ? (uint16_t)count : READ_BLOCK_LEN;
+        
+        readBlock(address, block, length);
+        crc = crc32Words(crc, block, length);
+        
+        address += (uint32_t)length << 1;
+        count -= length;
+        ClrWdt();
+        
+        /* a long range would otherwise overrun the UART, at startup before
+         * hostPresent() looks as well as for CMD_READ_CRC, and hold up the 
+         * reply before it */
+        rxPoll();
+        txPump();
+    }
+    
+    return ~crc;
+}
+#endif
+
+#if defined(BOOT_STATS)
+void statsRecord(uint16_t* count, uint32_t* total, uint32_t* longest, uint32_t start){
+    uint32_t cycles = statsTimer() - start;
+    
+    (*count)++;
+    *total += cycles;
+    if(cycles > *longest)
+        *longest = cycles;
+}
+
+void statsCommand(uint8_t cmd, uint32_t start){
+    uint16_t i;
+    
+    for(i=0; i<statsCommands; i++){
+        if(statsCmd[i] == cmd)
+            break;
+    }
+    
+    /* once the table is full, any other command goes untimed */
+    if(i == statsCommands){
+        if(statsCommands == STATS_COMMANDS)
+            return;
+        
+        statsCmd[i] = cmd;
+        statsCommands++;
+    }
+    
+    statsRecord(&statsCmdCount[i], &statsCmdCycles[i], &statsCmdLongest[i], start);
+}
+
+uint16_t statsPack(uint8_t* dest){
+    uint8_t* bytes = dest;
+    uint16_t i;
+    
+    /* laid out as described with STATS_LEN() */
+    bytes = packLittle(bytes, FCY, 4);
+    bytes = packLittle(bytes, statsChecksums, 2);
+    bytes = packLittle(bytes, statsStale, 2);
+    bytes = packLittle(bytes, rxOverruns, 2);
+    bytes = packLittle(bytes, rxDropped, 2);
+    bytes = packLittle(bytes, statsDecodeCycles, 4);
+    bytes = packLittle(bytes, statsTxWaitCycles, 4);
+    
+    for(i=0; i<STATS_NVM_OPERATIONS; i++){
+        bytes = packLittle(bytes, statsNvmCount[i], 2);
+        bytes = packLittle(bytes, statsNvmCycles[i], 4);
+        bytes = packLittle(bytes, statsNvmLongest[i], 4);
+    }
+    
+    for(i=0; i<statsCommands; i++){
+        bytes = packLittle(bytes, statsCmd[i], 1);
+        bytes = packLittle(bytes, statsCmdCount[i], 2);
+        bytes = packLittle(bytes, statsCmdCycles[i], 4);
+        bytes = packLittle(bytes, statsCmdLongest[i], 4);
+    }
+    
+    return (uint16_t)(bytes - dest);
+}
+#endif
+
+#if defined(BOOT_TRACE)
+void traceRecord(uint8_t event, uint16_t arg){
+    TraceRecord* record;
+    
+    if((uint16_t)(traceHead - traceTail) >= TRACE_LEN){
+        traceLost++;
+        return;
+    }
+    
+    record = &traceRing[traceHead & (TRACE_LEN - 1)];
+    record->time = statsTimer();
+    record->arg = arg;
+    record->event = event;
+    traceHead++;
+}
+
+void txTrace(uint8_t cmd){
+    TraceRecord* record;
+    uint16_t count = traceHead - traceTail;
+    uint16_t length, i;
+    uint8_t header[TRACE_HEADER_LEN];
+    
+    /* anything recorded while this reply goes out is left for the next */
+    if(count > TRACE_DUMP_LEN)
+        count = TRACE_DUMP_LEN;
+    length = TRACE_HEADER_LEN + (count * TRACE_RECORD_LEN);
+    
+    packLittle(packLittle(packLittle(header, FCY, 4), traceLost, 2), count, 2);
+    traceLost = 0;
+    
+    txStart();
+    txByte((uint8_t)(length & 0xff));
+    txByte((uint8_t)((length & 0xff00) >> 8));
+    txByte(cmd);
+    
+    for(i=0; i<TRACE_HEADER_LEN; i++){
+        txByte(header[i]);
+    }
+    
+    while(count--){
+        record = &traceRing[traceTail & (TRACE_LEN - 1)];
+        
+        for(i=0; i<4; i++){
+            txByte((uint8_t)(record->time >> (i * 8)));
+        }
+        txByte((uint8_t)(record->arg & 0xff));
+        txByte((uint8_t)(record->arg >> 8));
+        txByte(record->event);
+        
+        traceTail++;
+    }
+    
+    txEnd();
+}
+#endif
+
+#if defined(TX_PACKED)
+void txPacked(uint8_t cmd, uint32_t address, uint16_t count){
+    uint32_t block[READ_BLOCK_LEN];
+    uint16_t length = 4 + (count * 3);
+    uint16_t i, j;
+    
+    txStart();
+    txByte((uint8_t)(length & 0xff));
+    txByte((uint8_t)((length & 0xff00) >> 8));
+    txByte(cmd);
+    
+    for(i=0; i<4; i++){
+        txByte((uint8_t)(address >> (i * 8)));
+    }
+    
+    /* the flash is read a block at a time while the UART drains, and the
+     * phantom byte of each instruction is left out */
+    while(count > 0){
+        length = (count < READ_BLOCK_LEN) ? count : READ_BLOCK_LEN;
+        readBlock(address, block, length);
+        
+        for(i=0; i<length; i++){
+            for(j=0; j<3; j++){
+                txByte((uint8_t)(block[i] >> (j * 8)));
+            }
+        }
+        
+        address += (uint32_t)length << 1;
+        count -= length;
+    }
+    
+    txEnd();
+}
+#endif
+
 void txStart(void){
     f16_sum1 = f16_sum2 = 0;
     
-    while(U1STAbits.UTXBF); /* wait for tx buffer to empty */
-    U1TXREG = START_OF_FRAME;
+    TRACE(TRACE_TX_START, 0);
+    
+#if defined(BOOT_COBS)
+    /* a COBS frame has no start byte, since the zero that ended the last 
+     * one serves */
+    if(framing == FRAMING_COBS){
+        txCobsRun = 1;
+        return;
+    }
+#endif
+    
+    txPut(START_OF_FRAME);
+}
+
+void txWait(void){
+#if defined(BOOT_STATS)
+    uint32_t start;
+    
+    if((uint16_t)(txRingHead - txRingTail) < TX_RING_LEN)
+        return;
+    
+    start = statsTimer();
+    while((uint16_t)(txRingHead - txRingTail) >= TX_RING_LEN){
+        txPump();
+        rxPoll();
+    }
+    statsTxWaitCycles += statsTimer() - start;
+#else
+    while((uint16_t)(txRingHead - txRingTail) >= TX_RING_LEN){
+        txPump();
+        rxPoll();
+    }
+#endif
+}
+
+void txPut(uint8_t byte){
+    txWait();
+    txRing[txRingHead & (TX_RING_LEN - 1)] = byte;
+    txRingHead++;
+    
+    txPump();
+}
+
+bool txPending(void){
+    return txRingHead != txRingTail;
+}
+
+void txPump(void){
+    while(txPending() && !U1STAbits.UTXBF){
+        U1TXREG = txRing[txRingTail & (TX_RING_LEN - 1)];
+        txRingTail++;
+    }
+}
+
+void txFlush(void){
+    while(txPending()){
+        txPump();
+        rxPoll();
+    }
+    
+    while(!U1STAbits.TRMT);
 }
 
 void txByte(uint8_t byte){
+    fletcher16Accum(byte);
+    
+#if defined(BOOT_COBS)
+    if(framing == FRAMING_COBS){
+        /* each zero is sent as the code byte that ends the block before it,
+         * so that nothing has to be held back */
+        if(byte == 0){
+            txPut(txCobsRun);
+            txCobsRun = 1;
+        }else{
+            txPut(byte);
+            if(++txCobsRun == 0xff){
+                txPut(0xff);
+                txCobsRun = 1;
+            }
+        }
+        return;
+    }
+#endif
+    
     if((byte == START_OF_FRAME) || (byte == END_OF_FRAME) || (byte == ESC)){
-        while(U1STAbits.UTXBF); /* wait for tx buffer to empty */
-        U1TXREG = ESC;          /* send escape character */
-        
-        while(U1STAbits.UTXBF); /* wait */
-        U1TXREG = ESC_XOR ^ byte;
+        txPut(ESC);             /* send escape character */
+        txPut(ESC_XOR ^ byte);
     }else{
-        while(U1STAbits.UTXBF); /* wait */
-        U1TXREG = byte;
+        txPut(byte);
     }
-    
-    fletcher16Accum(byte);
 }
 
 void txEnd(void){
@@ -330,8 +1741,18 @@ void txEnd(void){
     txByte(sum1);
     txByte(sum2);
     
-    while(U1STAbits.UTXBF); /* wait for tx buffer to empty */
-    U1TXREG = END_OF_FRAME;
+#if defined(BOOT_COBS)
+    if(framing == FRAMING_COBS){
+        txPut(txCobsRun);
+        txPut(0);
+    }else{
+        txPut(END_OF_FRAME);
+    }
+#else
+    txPut(END_OF_FRAME);
+#endif
+    
+    TRACE(TRACE_TX_END, 0);
 }
 
 void txBytes(uint8_t cmd, uint8_t* bytes, uint16_t len){
@@ -349,6 +1770,27 @@ void txBytes(uint8_t cmd, uint8_t* bytes, uint16_t len){
     txEnd();
 }
 
+void txStatus(uint8_t cmd, uint8_t status){
+    uint8_t bytes[2];
+    
+    bytes[0] = status;
+    bytes[1] = cmd;
+    
+    txBytes(CMD_STATUS, bytes, 2);
+}
+
+#if defined(BOOT_SEQUENCED)
+void txWriteReply(uint8_t cmd, uint8_t status){
+    uint8_t bytes[3];
+    
+    bytes[0] = status;
+    bytes[1] = (uint8_t)(writeSeq & 0xff);
+    bytes[2] = (uint8_t)((writeSeq & 0xff00) >> 8);
+    
+    txBytes(cmd, bytes, 3);
+}
+#endif
+
 void txArray16bit(uint8_t cmd, uint16_t* words, uint16_t len){
     uint16_t length = len << 1;
     txBytes(cmd, (uint8_t*) words, length);
@@ -9,6 +9,98 @@
 #define TX_BUF_LEN  ((MAX_PROG_SIZE * 4) + 0x10)
 #define RX_BUF_LEN  ((MAX_PROG_SIZE * 4) + 0x10)
 
+/**
+ * @brief the number of received bytes that can be held between the UART and
+ * the frame decoder, which must be a power of two
+ */
+#ifndef RX_RING_LEN
+#define RX_RING_LEN 64
+#endif
+
+/**
+ * @brief the number of encoded bytes that can wait for the UART's transmit
+ * FIFO, so that a reply drains while the next command is received and 
+ * processed, which must be a power of two
+ */
+#ifndef TX_RING_LEN
+#define TX_RING_LEN 64
+#endif
+
+/**
+ * @brief the time, in seconds, that an intact frame has to arrive in after
+ * CMD_SET_BAUD or CMD_SET_FRAMING before the link goes back to the settings
+ * that it had before
+ */
+#ifndef BAUD_CONFIRM_TIME
+#define BAUD_CONFIRM_TIME (0.5f)
+#endif
+
+/**
+ * @brief the time, in seconds, that the host has to send something after a
+ * reset before an application with a valid record is started, in place of
+ * BOOT_LOADER_TIME
+ * 
+ * The boot pin is only checked as well when BOOT_PIN_WIRED is defined, 
+ * since a pin that isn't connected can't be relied on to read high.
+ */
+#ifndef FAST_BOOT_TIME
+#define FAST_BOOT_TIME (0.05f)
+#endif
+
+/**
+ * @brief the word that an application leaves in bootMailbox[0] before a
+ * software reset to have the bootloader wait for the host
+ * 
+ * bootMailbox[1] must hold its complement, so that whatever RAM holds after
+ * a power-on reset isn't taken for a request.
+ */
+#define BOOT_MAILBOX_REQUEST 0xb007
+
+/**
+ * @brief the last two words of RAM, which the linker scripts of both the 
+ * bootloader and the application leave out of the data region
+ */
+extern volatile uint16_t bootMailbox[2];
+
+/**
+ * @brief the number of different commands that are timed when BOOT_STATS is
+ * defined
+ * 
+ * BOOT_STATS builds in CMD_READ_STATS and the counters and timings behind 
+ * it, which are measured with statsTimer().  Without it, none of that is 
+ * compiled.
+ */
+#ifndef STATS_COMMANDS
+#define STATS_COMMANDS 16
+#endif
+
+/**
+ * @brief the number of events held for CMD_READ_TRACE when BOOT_TRACE is 
+ * defined, which must be a power of two no larger than 0x8000
+ * 
+ * BOOT_TRACE records an event, timed with statsTimer(), as each frame 
+ * arrives and is handled and as each flash operation and reply starts and
+ * finishes.  Without it, none of that is compiled.
+ */
+#ifndef TRACE_LEN
+#define TRACE_LEN 128
+#endif
+
+/**
+ * @brief the attributes of _AltU1RXInterrupt(), the U1RX handler that 
+ * BOOT_RX_INTERRUPT builds in
+ * 
+ * BOOT_RX_INTERRUPT has the U1RX interrupt move received bytes into the 
+ * ring instead of the main loop polling for them, so that nothing is lost 
+ * while a long command has the main loop busy.  The interrupt is taken 
+ * through the alternate vector table, which leaves the application's table 
+ * alone, so only the ports that define U1RX_AIVT_ADDRESS, the U1RX slot of 
+ * that table, support it.  Without it, the bootloader uses no interrupts.
+ */
+#ifndef RX_ISR
+#define RX_ISR __attribute__((interrupt, no_auto_psv))
+#endif
+
 /**
  * @brief the byte that indicates the start of a frame
  */
@@ -30,6 +122,27 @@
  */
 #define ESC_XOR     0x20
 
+/**
+ * @brief the framings that CMD_SET_FRAMING chooses between
+ * 
+ * FRAMING_ESCAPED is the one above, which the bootloader always starts in;
+ * a frame full of the three special bytes doubles in length.  FRAMING_COBS
+ * costs at most one byte in 254, plus the zero that ends the frame, and no
+ * other zero is sent.
+ * 
+ * Towards the device, frames are in COBS proper: each block starts with a
+ * code byte, one more than the number of bytes that follow it before the 
+ * zero that the code stands for.  Replies are in the reverse, with each 
+ * code byte after its block, so that the bootloader can send them as they
+ * are produced and the host, which has the whole frame by then, decodes 
+ * them from the end.  In both, a code of 0xff stands for 254 bytes with no
+ * zero after them, and the last block of a frame has no zero after it.
+ */
+typedef enum{
+    FRAMING_ESCAPED = 0x00,
+    FRAMING_COBS    = 0x01
+}CommFraming;
+
 /** 
  * @brief commands available for the bootloader
  */
@@ -43,22 +156,214 @@ typedef enum{
     CMD_READ_MAX_PROG_SIZE  = 0x05,
     CMD_READ_APP_START_ADDR = 0x06,
     CMD_READ_BOOT_START_ADDR = 0x07,
+    CMD_READ_RX_ERRORS      = 0x08,
+    CMD_READ_DESCRIPTOR     = 0x09,
+    CMD_READ_STATS          = 0x0a,
+    CMD_READ_TRACE          = 0x0b,
+    
+    /* the number of page erases skipped since reset because the page was
+     * already blank, then the number of row writes skipped because the row
+     * already held the instructions, both 16 bits */
+    CMD_READ_SKIPPED        = 0x0c,
 
     /* erase operations */
     CMD_ERASE_PAGE  = 0x10,
+    
+    /* erases every page from the start address up to the end, leaving out 
+     * the bootloader, and replies once with the number of pages erased and
+     * the number found blank and skipped, both 16 bits */
+    CMD_ERASE_RANGE = 0x11,
             
     /* flash read memory operations */
     CMD_READ_ADDR   = 0x20,
     CMD_READ_MAX    = 0x21,
+    CMD_READ_MAX_PACKED = 0x22,
+    CMD_READ_CRC    = 0x23,
+    
+    /* answered with as many frames as it takes, each carrying its address 
+     * and up to MAX_PROG_SIZE instructions of 3 bytes */
+    CMD_READ_RANGE  = 0x24,
     
     /* flash write operations */
     CMD_WRITE_ROW   = 0x30,
     CMD_WRITE_MAX_PROG_SIZE = 0x31,
+    
+    /* sequenced flash write operations, each of which is answered with a
+     * CommStatus and the sequence number expected next */
+    CMD_WRITE_SEQ_RESET = 0x32,
+    CMD_WRITE_ROW_SEQ   = 0x33,
+    CMD_WRITE_MAX_SEQ   = 0x34,
+    CMD_WRITE_ROW_PACKED = 0x36,
+    CMD_WRITE_MAX_PACKED = 0x37,
+    
+    /* records the length and CRC-32 of the application once it has been 
+     * programmed, so that it can be started without waiting */
+    CMD_WRITE_APP_RECORD = 0x38,
+    
+    /* a write session, opened at an address, whose frames carry only their
+     * sequence number and MAX_PROG_SIZE packed instructions, each written 
+     * just past the last; it is closed explicitly or by a gap in the 
+     * sequence */
+    CMD_WRITE_SESSION_OPEN  = 0x39,
+    CMD_WRITE_SESSION       = 0x3a,
+    CMD_WRITE_SESSION_CLOSE = 0x3b,
             
     /* application */
-    CMD_START_APP   = 0x40
+    CMD_START_APP   = 0x40,
+            
+    /* replies */
+    CMD_STATUS      = 0x50,
+            
+    /* link settings */
+    CMD_SET_BAUD    = 0x60,
+    CMD_SET_FRAMING = 0x61
 }CommCommand;
 
+/**
+ * @brief the status sent in reply to a frame
+ * 
+ * The sequenced writes always reply with a status, which is cumulative: 
+ * every frame before the sequence number that accompanies it has been
+ * handled.  STATUS_OUT_OF_ORDER means that the frame was not written, so it
+ * and anything sent after it must be sent again.
+ * 
+ * Any other frame that is refused is answered with CMD_STATUS, carrying the
+ * status and the command that was refused, or CMD_STATUS itself for a frame 
+ * too short to carry a command.
+ */
+typedef enum{
+    STATUS_OK               = 0x00,
+    STATUS_OUT_OF_ORDER     = 0x01,
+    STATUS_CHECKSUM         = 0x02,   /* the frame was corrupted */
+    STATUS_PROTECTED        = 0x03,   /* the address belongs to the bootloader */
+    STATUS_LENGTH           = 0x04,   /* the frame is too short or too long */
+    STATUS_UNKNOWN_COMMAND  = 0x05,
+    STATUS_BAUD_RATE        = 0x07,   /* the rate can't be generated within 2% */
+    STATUS_VERIFY           = 0x08,   /* the application doesn't match the record */
+    STATUS_FRAMING          = 0x09    /* the framing isn't one of CommFraming */
+}CommStatus;
+
+/**
+ * @brief the layout of the CMD_READ_DESCRIPTOR reply, which carries 
+ * everything that the other reads in 0x00-0x08 do in a single frame
+ * 
+ * The reply is packed and little-endian: this version (8 bits), the row 
+ * and page lengths (16 bits), the program length (32 bits), MAX_PROG_SIZE 
+ * (16 bits), the application and bootloader start addresses (32 bits), 
+ * RX_BUF_LEN (16 bits), the capabilities (32 bits), then VERSION_STRING and
+ * PLATFORM_STRING in fields of 16 and 20 bytes, padded with zeros.  Later
+ * versions only add fields to the end.
+ */
+#define DESCRIPTOR_VERSION  1
+#define DESCRIPTOR_LEN      (1 + 2 + 2 + 4 + 2 + 4 + 4 + 2 + 4 + 16 + 20)
+
+/**
+ * @brief the optional commands, as reported in the capabilities of the 
+ * CMD_READ_DESCRIPTOR reply
+ */
+#define CAP_RX_ERRORS       (1UL << 0)  /* CMD_READ_RX_ERRORS */
+#define CAP_STATUS          (1UL << 1)  /* refused frames are answered with CMD_STATUS */
+#define CAP_SEQUENCED       (1UL << 2)  /* CMD_WRITE_SEQ_RESET, _ROW_SEQ and _MAX_SEQ */
+#define CAP_PACKED          (1UL << 4)  /* CMD_READ_MAX_PACKED, CMD_WRITE_ROW_PACKED and _MAX_PACKED */
+#define CAP_CRC             (1UL << 5)  /* CMD_READ_CRC */
+#define CAP_SET_BAUD        (1UL << 6)  /* CMD_SET_BAUD */
+#define CAP_APP_RECORD      (1UL << 7)  /* CMD_WRITE_APP_RECORD */
+#define CAP_STATS           (1UL << 8)  /* CMD_READ_STATS */
+#define CAP_TRACE           (1UL << 9)  /* CMD_READ_TRACE */
+#define CAP_READ_RANGE      (1UL << 10) /* CMD_READ_RANGE */
+#define CAP_COBS            (1UL << 11) /* CMD_SET_FRAMING with FRAMING_COBS */
+#define CAP_ERASE_RANGE     (1UL << 12) /* CMD_ERASE_RANGE */
+#define CAP_READ_SKIPPED    (1UL << 13) /* CMD_READ_SKIPPED, and unneeded erases and writes are skipped */
+#define CAP_RX_INTERRUPT    (1UL << 14) /* BOOT_RX_INTERRUPT, which keeps the U1RX slot of the AIVT */
+#define CAP_SESSION         (1UL << 15) /* CMD_WRITE_SESSION_OPEN, _SESSION and _SESSION_CLOSE */
+
+/**
+ * @brief the capabilities of every build; the rest are reported for the 
+ * options that build them in
+ * 
+ * The bootloader has to fit ahead of APPLICATION_START_ADDRESS, so only 
+ * what every loader needs is built by default.  Each of these adds the 
+ * commands of the capability with the same name, and the rest of the tree
+ * treats a command that isn't built in as unknown:
+ * 
+ * BOOT_SEQUENCED, BOOT_PACKED (which needs BOOT_SEQUENCED), BOOT_SESSION 
+ * (which also needs BOOT_SEQUENCED), BOOT_CRC, BOOT_READ_RANGE, 
+ * BOOT_ERASE_RANGE, BOOT_SET_BAUD, BOOT_COBS, BOOT_READ_SKIPPED, 
+ * BOOT_APP_RECORD for CMD_WRITE_APP_RECORD and starting a recorded 
+ * application right away, on the ports that have room for the record, and 
+ * BOOT_DESCRIPTOR for CMD_READ_DESCRIPTOR, without which a loader sees none 
+ * of these.
+ */
+#define CAPABILITIES (CAP_RX_ERRORS | CAP_STATUS)
+
+/**
+ * @brief the flash operations that are timed when BOOT_STATS is defined
+ */
+typedef enum{
+    STATS_NVM_ERASE         = 0,    /* eraseByAddress() */
+    STATS_NVM_DOUBLE_WORD   = 1,    /* doubleWordWrite() */
+    STATS_NVM_ROW           = 2,    /* writeRow() */
+    STATS_NVM_OPERATIONS    = 3
+}StatsNvm;
+
+/**
+ * @brief the layout of the CMD_READ_STATS reply
+ * 
+ * The reply is packed and little-endian: FCY (32 bits), then the frames 
+ * refused for their checksum, the partial frames discarded as stale, the
+ * receive overruns and the bytes dropped from a full receive ring (16 bits
+ * each), then the cycles spent decoding received bytes and waiting on the 
+ * transmitter (32 bits each).  Each of the STATS_NVM_OPERATIONS follows as
+ * a count (16 bits), the total cycles and the longest (32 bits each).  Last
+ * come the commands in the order they were first received, up to
+ * STATS_COMMANDS of them, each as the command (8 bits), a count, and the 
+ * total and longest cycles, which run from the end of the frame to the end 
+ * of the reply.  Cycles are counted since reset by a 32-bit timer, so the 
+ * totals wrap around.
+ */
+#define STATS_LEN(commands) (4 + (2 * 4) + (4 * 2) \
+        + (STATS_NVM_OPERATIONS * (2 + 4 + 4)) + ((commands) * (1 + 2 + 4 + 4)))
+
+/**
+ * @brief the events recorded when BOOT_TRACE is defined, each with an 
+ * argument
+ */
+typedef enum{
+    TRACE_FRAME_START   = 0x01,   /* a start byte was decoded */
+    TRACE_FRAME_END     = 0x02,   /* an end byte was decoded; the frame length */
+    TRACE_DECODE_DONE   = 0x03,   /* a frame is taken for processing; the command, and the status above it */
+    TRACE_COMMAND_END   = 0x04,   /* the command has been handled; the command */
+    TRACE_NVM_START     = 0x05,   /* a StatsNvm operation starts; the operation */
+    TRACE_NVM_END       = 0x06,   /* and finishes; the operation */
+    TRACE_TX_START      = 0x07,   /* a reply starts */
+    TRACE_TX_END        = 0x08    /* its end byte has been handed to the UART */
+}TraceEvent;
+
+/**
+ * @brief one recorded event
+ */
+typedef struct{
+    uint32_t time;      /* statsTimer() when it was recorded */
+    uint16_t arg;
+    uint8_t event;      /* a TraceEvent */
+}TraceRecord;
+
+/**
+ * @brief the layout of the CMD_READ_TRACE reply
+ * 
+ * The reply is packed and little-endian: FCY (32 bits), the events lost
+ * because the trace was full and the number of records that follow (16 bits
+ * each), then up to TRACE_DUMP_LEN records, oldest first, each as the time
+ * (32 bits), the argument (16 bits) and the event (8 bits).  The records 
+ * sent are removed, so the host reads until a reply is not full; the
+ * events of reading the trace are recorded like any others.  Decoded
+ * bytes are timed as the decoder reaches them, which can be a little after
+ * they arrived.
+ */
+#define TRACE_DUMP_LEN      64
+#define TRACE_RECORD_LEN    (4 + 2 + 1)
+#define TRACE_HEADER_LEN    (4 + 2 + 2)
+
 
 
 /**
@@ -66,13 +371,148 @@ typedef enum{
  */
 void initPins(void);
 
+/**
+ * @brief checks the application record against the application
+ * @return true if the record is there and the CRC-32 of the application
+ * matches it
+ */
+bool appRecordValid(void);
+
+/**
+ * @brief checks the boot mailbox for a request from the application, and 
+ * clears it
+ * @return true if the application asked for the bootloader to wait for the
+ * host
+ */
+bool updateRequested(void);
+
+/**
+ * @brief waits FAST_BOOT_TIME for the host to send something
+ * @return true if anything was received, or the boot pin holds the 
+ * bootloader
+ */
+bool hostPresent(void);
+
 /**
  * @brief receives data from the UART
  */
 void receiveBytes(void);
 
 /**
- * @brief processes the rx buffer into commands with parameters from packets
+ * @brief moves any bytes waiting in the UART into the receive ring, unless 
+ * the U1RX interrupt has been enabled to do that instead
+ */
+void rxPoll(void);
+
+/**
+ * @brief tells whether received bytes are waiting in the ring for the 
+ * decoder
+ * @return true if there are any
+ */
+bool rxPending(void);
+
+/**
+ * @brief moves any bytes waiting in the UART into the receive ring, counting
+ * bytes that do not fit and clearing receive overruns
+ */
+void rxDrain(void);
+
+#if defined(BOOT_RX_INTERRUPT)
+/**
+ * @brief the U1RX interrupt handler, taken through the alternate vector 
+ * table while the bootloader runs
+ */
+void RX_ISR _AltU1RXInterrupt(void);
+#endif
+
+/**
+ * @brief points the U1RX slot of the alternate vector table at 
+ * _AltU1RXInterrupt() if it is blank, and enables the interrupt if the slot
+ * holds it; otherwise, received bytes are polled as usual
+ * 
+ * Does nothing without BOOT_RX_INTERRUPT.
+ */
+void rxInterruptStart(void);
+
+/**
+ * @brief programs the U1RX slot of the alternate vector table with the 
+ * address of _AltU1RXInterrupt(), after the page holding it was erased
+ */
+void writeRxVector(void);
+
+/**
+ * @brief disables the U1RX interrupt and the alternate vector table, if 
+ * BOOT_RX_INTERRUPT enabled them, and starts the application
+ */
+void exitBootloader(void);
+
+/**
+ * @brief waits for the flash operation that was just started to finish,
+ * moving received bytes into the ring while it runs and once it is done
+ * 
+ * The ports call this right after setting NVMCON.WR.  The flash controllers 
+ * of the supported parts stall the CPU for the operation, so it has finished 
+ * by the time this runs and only the bytes left in the UART are moved.
+ */
+void nvmWait(void);
+
+/**
+ * @brief feeds one received byte to the frame decoder, which removes escape
+ * characters and accumulates the fletcher checksum as the frame arrives
+ * @param byte the byte received
+ * @return true if the byte ended a frame, whether or not it is valid
+ */
+bool decodeByte(uint8_t byte);
+
+/**
+ * @brief the part of decodeByte() for FRAMING_COBS, which restores each 
+ * zero as the code byte after it arrives
+ * @param byte the byte received
+ * @return true if the byte ended a frame, whether or not it is valid
+ */
+bool decodeCobs(uint8_t byte);
+
+/**
+ * @brief resets the decoder for a frame that has just begun
+ */
+void rxStartFrame(void);
+
+/**
+ * @brief adds a decoded byte to the frame, accumulating the checksum of the
+ * byte two behind it
+ * @param byte the decoded byte
+ */
+void rxAppend(uint8_t byte);
+
+/**
+ * @brief checks the length and checksum of the frame that has just ended
+ * @return true, for decodeByte() to return
+ */
+bool rxEndFrame(void);
+
+/**
+ * @brief switches the UART to another baud rate, once everything that has
+ * been sent has left the transmitter
+ * @param brg the value for U1BRG
+ * @param highSpeed true for the divide-by-4 (BRGH) mode
+ */
+void uartSetBrg(uint16_t brg, bool highSpeed);
+
+/**
+ * @brief remembers the baud rate and framing in use, which the link goes 
+ * back to unless an intact frame arrives within BAUD_CONFIRM_TIME of the
+ * change that follows
+ */
+void linkChanging(void);
+
+/**
+ * @brief goes back to the baud rate and framing that linkChanging() 
+ * remembered, once the time for confirming the change has run out
+ */
+void linkFallBack(void);
+
+/**
+ * @brief processes the frame completed by the decoder, if there is one
  */
 void processReceived(void);
 
@@ -84,13 +524,174 @@ void processReceived(void);
 void processCommand(uint8_t* data);
 
 /**
- * @brief send the start byte and initialize fletcher checksum accumulator
+ * @brief returns the smallest payload that a command can be processed with
+ * @param cmd the command
+ * @return the payload length, in bytes
+ */
+uint16_t commandLength(uint8_t cmd);
+
+/**
+ * @brief erases the page at an address unless it is already blank, putting
+ * back the jump to the bootloader if it was the first page
+ * @param address an address within the page, outside of the bootloader
+ * @return true if the page was erased, or false if it was skipped
+ */
+bool erasePage(uint32_t address);
+
+/**
+ * @brief checks whether every instruction of a page reads 0xffffff
+ * @param address an address on a page boundary
+ * @return true if the page is blank
+ */
+bool pageBlank(uint32_t address);
+
+/**
+ * @brief programs a row with writeRow(), unless it already holds the 
+ * instructions
+ * @param address an address on a row boundary
+ * @param words the instructions, one per word
+ */
+void programRow(uint32_t address, uint32_t* words);
+
+/**
+ * @brief compares instructions with those in flash, ignoring the phantom
+ * byte of each word
+ * @param address the address of the first instruction
+ * @param words the instructions, one per word
+ * @param count the number of instructions
+ * @return true if flash already holds every one of them
+ */
+bool flashMatches(uint32_t address, uint32_t* words, uint16_t count);
+
+/**
+ * @brief unpacks little-endian instructions from a frame into the layout
+ * that writeRow() and doubleWordWrite() expect
+ * @param words the destination, one instruction per word
+ * @param bytes the instructions as received
+ * @param count the number of instructions
+ * @param width the bytes per instruction in the frame, 3 for the packed 
+ * commands or 4 for the others
+ */
+void unpackWords(uint32_t* words, uint8_t* bytes, uint16_t count, uint8_t width);
+
+/**
+ * @brief stores a value little-endian
+ * @param dest where to store the value
+ * @param value the value
+ * @param width the number of bytes to store
+ * @return the byte after the value
+ */
+uint8_t* packLittle(uint8_t* dest, uint32_t value, uint8_t width);
+
+/**
+ * @brief accumulates instructions into a CRC-32 (the reflected 0xEDB88320
+ * polynomial used by zlib), taking the 3 bytes of each instruction lowest 
+ * first and skipping the phantom byte
+ * @param crc the running value, which starts at 0xffffffff and is inverted 
+ * once every instruction has been accumulated
+ * @param words the instructions, as read by readBlock()
+ * @param count the number of instructions
+ * @return the new running value
+ */
+uint32_t crc32Words(uint32_t crc, uint32_t* words, uint16_t count);
+
+/**
+ * @brief calculates the CRC-32 of a range of flash, as crc32Words() does
+ * @param address the starting address
+ * @param count the number of instructions
+ * @return the CRC-32
+ */
+uint32_t crcRange(uint32_t address, uint32_t count);
+
+/**
+ * @brief adds one timing to a set of BOOT_STATS counters
+ * @param count the number of times counted
+ * @param total the total cycles
+ * @param longest the longest time counted, in cycles
+ * @param start the value of statsTimer() when the timing started
+ */
+void statsRecord(uint16_t* count, uint32_t* total, uint32_t* longest, uint32_t start);
+
+/**
+ * @brief adds the time taken by a command to the BOOT_STATS counters
+ * @param cmd the command
+ * @param start the value of statsTimer() when the frame was complete
+ */
+void statsCommand(uint8_t cmd, uint32_t start);
+
+/**
+ * @brief lays out the CMD_READ_STATS reply
+ * @param dest where to lay it out, at least STATS_LEN(STATS_COMMANDS) bytes
+ * @return the length of the reply
+ */
+uint16_t statsPack(uint8_t* dest);
+
+/**
+ * @brief records an event for CMD_READ_TRACE, or counts it as lost if the
+ * trace is full
+ * @param event a TraceEvent
+ * @param arg the argument, which depends on the event
+ */
+void traceRecord(uint8_t event, uint16_t arg);
+
+/**
+ * @brief sends the oldest recorded events in a CMD_READ_TRACE reply, and 
+ * removes them from the trace
+ * @param cmd the command being replied to
+ */
+void txTrace(uint8_t cmd);
+
+/**
+ * @brief transmits a frame of instructions read straight from flash, as the
+ * address followed by 3 bytes for each instruction
+ * @param cmd the type of message
+ * @param address the address of the first instruction
+ * @param count the number of instructions
+ */
+void txPacked(uint8_t cmd, uint32_t address, uint16_t count);
+
+/**
+ * @brief queue the start byte and initialize fletcher checksum accumulator
  */
 void txStart(void);
 
 /**
- * @brief transmits a single byte, escaping if necessary, along with 
- * accumulating the fletcher checksum
+ * @brief waits for room in the transmit ring, keeping the UART fed and 
+ * moving anything received in the meantime into the receive ring
+ */
+void txWait(void);
+
+/**
+ * @brief queues a byte, already escaped or encoded, for the UART and tops up
+ * its transmit FIFO
+ * @param byte the byte as it goes on the wire
+ */
+void txPut(uint8_t byte);
+
+/**
+ * @brief tells whether any queued bytes have yet to reach the UART
+ * @return true if the transmit ring holds anything
+ */
+bool txPending(void);
+
+/**
+ * @brief moves queued bytes into the UART's transmit FIFO for as long as it
+ * has room, without waiting
+ * 
+ * The main loop and the waits for the UART and the flash call this, so that
+ * a reply goes out while whatever follows it runs.
+ */
+void txPump(void);
+
+/**
+ * @brief waits until every queued byte has been shifted out, before the 
+ * link settings change or the application starts
+ */
+void txFlush(void);
+
+/**
+ * @brief transmits a single byte, escaping or encoding it for the framing in
+ * use, along with accumulating the fletcher checksum
  * @param byte a byte of data to transmit
  */
 void txByte(uint8_t byte);
@@ -113,6 +714,21 @@ void txBytes(uint8_t cmd, uint8_t* bytes, uint16_t len);
  */
 void txArray8bit(uint8_t cmd, uint8_t* bytes, uint16_t len);
 
+/**
+ * @brief transmits a CMD_STATUS reply for a frame that was refused
+ * @param cmd the command that was refused
+ * @param status a CommStatus
+ */
+void txStatus(uint8_t cmd, uint8_t status);
+
+/**
+ * @brief transmits the reply to a sequenced write, along with the sequence
+ * number that is expected next
+ * @param cmd the command being replied to
+ * @param status a CommStatus
+ */
+void txWriteReply(uint8_t cmd, uint8_t status);
+
 /**
  * @brief convenience function for transmitting an array of 16-bit words
  * with the associated command
@@ -140,7 +756,8 @@ void txString(uint8_t cmd, char* str);
 
 /**
  * @brief appends the checksum, properly escaping the sequence where necessary,
- * and sends the end byte
+ * and sends the end byte, or the last code byte and the zero for 
+ * FRAMING_COBS
  */
 void txEnd(void);
 
@@ -52,6 +52,8 @@
  * A value of 0x80 should work on all microcontrollers.  Larger values will
  * allow faster programming operations, but will consume more RAM.
  */
+#ifndef MAX_PROG_SIZE
 #define MAX_PROG_SIZE 0x80
+#endif
 
 #endif
\ No newline at end of file
@@ -55,7 +55,7 @@ void initUart(void){
     /*           instFreq                           */
     /*  BRG = --------------- - 1                   */
     /*        (16 * baudRate)                       */
-    U1BRG = 31;
+    U1BRG = FCY / (16.0f * UART_BAUD_RATE) - 1;
     RPINR18bits.U1RXR = RX_RPNUM; /* U1RX assigned to RP25 */
     
     /* make the RX pin an input */
@@ -116,7 +116,24 @@ void initTimers(void){
     TMR2 = 0;
 
     T2CON = 0x8030; /* prescaler = 256 */
+    
+#if defined(BOOT_STATS) || defined(BOOT_TRACE)
+    /* timers 4 and 5 run together as a free-running 32-bit timer for 
+     * statsTimer() */
+    TMR5 = TMR4 = 0;
+    PR5 = PR4 = 0xffff;
+    T4CON = 0x8008; /* 32-bit, prescaler = 1 */
+#endif
+}
+
+#if defined(BOOT_STATS) || defined(BOOT_TRACE)
+uint32_t statsTimer(void){
+    /* reading TMR4 latches TMR5 into TMR5HLD */
+    uint16_t low = TMR4;
+    
+    return ((uint32_t)TMR5HLD << 16) | low;
 }
+#endif
 
 bool readBootPin(void){
 #if defined(BOOT_PORT_A)
@@ -164,17 +181,15 @@ bool should_abort_boot(uint16_t counterValue) {
 }
 
 void writeRow(uint32_t address, uint32_t words[_FLASH_ROW]){
-    doubleWordWrite(address, words);
-}
-
-void writeMax(uint32_t address, uint32_t* progData){
-    uint32_t i;
+    uint16_t i;
     
-    for(i = 0; i < (MAX_PROG_SIZE << 1); i += 4){
-        uint32_t addr = address + i;
+    for(i = 0; i < _FLASH_ROW; i += 2, address += 4){
+        /* the reset vector was programmed when its page was erased, and 
+         * programming all ones changes nothing but still takes as long */
+        if((address < __IVT_BASE) 
+                || (((words[i] & words[i + 1]) & 0xffffff) == 0xffffff))
+            continue;
         
-        /* do not allow application to overwrite the reset vector */
-        if(addr >= __IVT_BASE)
-            writeRow(addr, &progData[i >> 1]);
+        doubleWordWrite(address, &words[i]);
     }
 }
@@ -40,6 +40,11 @@
 #define TX_PIN 4
 #define TX_RPNUM 20
 
+/* UART communication baud rate, in Hz */
+#ifndef UART_BAUD_RATE
+#define UART_BAUD_RATE 115200
+#endif
+
 /**
  * @brief this is an approximation of the time that the bootloader will remain
  * active at startup before moving on to the application
@@ -53,11 +58,16 @@
  * A value of 0x80 should work on all microcontrollers.  Larger values will
  * allow faster programming operations, but will consume more RAM.
  */
+#ifndef MAX_PROG_SIZE
 #define MAX_PROG_SIZE 0x80
-#define APPLICATION_START_ADDRESS 0x1400
+#endif
+#define APPLICATION_START_ADDRESS 0x2000
 #define TIME_PER_TMR2_50k 0.213
 #define FCY 60000000UL  /* instruction clock frequency, in Hz */
 
+/* FGS to FICD are kept in the last page of flash */
+#define CONFIG_PAGE_ADDRESS (__PROGRAM_LENGTH - (_FLASH_PAGE << 1))
+
 #define NUM_OF_TMR2_OVERFLOWS (uint16_t)((BOOT_LOADER_TIME/TIME_PER_TMR2_50k) + 1.0)
 
 #define PLATFORM_STRING "dspic33ep64mc504"
@@ -95,6 +105,21 @@ bool should_abort_boot(uint16_t counterValue);
  */
 uint32_t readAddress(uint32_t address);
 
+/**
+ * @brief reads consecutive instructions, starting at the address
+ * @param address the starting address (must be even)
+ * @param words the buffer that receives the instructions
+ * @param count the number of instructions to read
+ */
+void readBlock(uint32_t address, uint32_t* words, uint16_t count);
+
+/**
+ * @brief reads the free-running 32-bit timer that BOOT_STATS and BOOT_TRACE
+ * measure with, which counts instruction cycles
+ * @return the count
+ */
+uint32_t statsTimer(void);
+
 /**
  * @brief erases the flash page starting at the address
  * @param address
@@ -118,18 +143,12 @@ void writeInstr(uint32_t address, uint32_t instruction);
 void doubleWordWrite(uint32_t address, uint32_t* progDataArray);
 
 /**
- * @brief writes an entire row of instructions, starting at the address
+ * @brief writes an entire row of instructions, starting at the address, a
+ * double word at a time since these parts have no row programming; double
+ * words that are blank or hold the reset vector are left alone
  * @param address the starting address (must start a flash row)
  * @param words a buffer containing the instructions to write
  */
 void writeRow(uint32_t address, uint32_t words[_FLASH_ROW]);
 
-/**
- * @brief writes the maximum number of instructions
- * @param address the starting address
- * @param progData a 32-bit, 2-element array containing the instruction words
- * to be written to flash
- */
-void writeMax(uint32_t address, uint32_t* progData);
-
 #endif
\ No newline at end of file
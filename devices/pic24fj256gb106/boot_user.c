@@ -1,6 +1,7 @@
 /// Device-specific implementation details
 #include "xc.h"
 #include "boot_user.h"
+#include "bootloader.h"
 
 bool readBootPin(void);
 
@@ -136,7 +137,24 @@ void initTimers(void){
     TMR2 = 0;
 
     T2CON = 0x8030; /* prescaler = 256 */
+    
+#if defined(BOOT_STATS) || defined(BOOT_TRACE)
+    /* timers 4 and 5 run together as a free-running 32-bit timer for 
+     * statsTimer() */
+    TMR5 = TMR4 = 0;
+    PR5 = PR4 = 0xffff;
+    T4CON = 0x8008; /* 32-bit, prescaler = 1 */
+#endif
+}
+
+#if defined(BOOT_STATS) || defined(BOOT_TRACE)
+uint32_t statsTimer(void){
+    /* reading TMR4 latches TMR5 into TMR5HLD */
+    uint16_t low = TMR4;
+    
+    return ((uint32_t)TMR5HLD << 16) | low;
 }
+#endif
 
 bool should_abort_boot(uint16_t counterValue) {
 	if(counterValue > NUM_OF_TMR2_OVERFLOWS){
@@ -169,6 +187,7 @@ void eraseByAddress(uint32_t address){
 	__builtin_tblwtl(offset, 0);
 	__builtin_disi(5);
 	__builtin_write_NVM();
+	nvmWait();
 
 	TBLPAG = tempTblPag;
 }
@@ -188,6 +207,26 @@ uint32_t readAddress(uint32_t address){
 	return result;
 }
 
+void readBlock(uint32_t address, uint32_t* words, uint16_t count){
+    uint16_t tempTblPag = TBLPAG;
+    uint16_t offset = (uint16_t)(address & 0x0000ffff);
+    uint16_t i;
+    
+    TBLPAG = (uint16_t)((address & 0x00ff0000) >> 16); // initialize PM Page Boundary
+    
+    for(i=0; i<count; i++){
+        words[i] = (((uint32_t)__builtin_tblrdh(offset)) << 16)
+                | ((uint32_t)__builtin_tblrdl(offset));
+        offset += 2;
+        
+        /* carry into the next page of program memory */
+        if(offset == 0)
+            TBLPAG++;
+    }
+    
+    TBLPAG = tempTblPag;
+}
+
 void writeInstr(uint32_t address, uint32_t instruction){
 	uint16_t tempTblPag = TBLPAG; 
 
@@ -200,6 +239,7 @@ void writeInstr(uint32_t address, uint32_t instruction){
 	__builtin_tblwth(offset, (uint16_t)((instruction & 0x00ff0000) >> 16));
 	__builtin_disi(5);
 	__builtin_write_NVM();
+	nvmWait();
 
 	TBLPAG = tempTblPag;
 }
@@ -219,6 +259,7 @@ void writeRow(uint32_t address, uint32_t* words){
 	}
 	__builtin_disi(5);
 	__builtin_write_NVM();
+	nvmWait();
 
 	TBLPAG = tempTblPag;
 }
@@ -228,15 +269,6 @@ void doubleWordWrite(uint32_t address, uint32_t* progDataArray){
 	writeInstr(address+2, progDataArray[1]);
 }
 
-void writeMax(uint32_t address, uint32_t* progData){
-	uint16_t i;
-	uint16_t length = (uint16_t)(MAX_PROG_SIZE/_FLASH_ROW);
-	
-	for (i=0; i < length; i++){
-		writeRow(address + ((i * _FLASH_ROW) << 1), &progData[i*_FLASH_ROW]); 
-	}
-}
-
 void startApp(uint16_t applicationAddress){
 	asm("goto w0");
 }
\ No newline at end of file
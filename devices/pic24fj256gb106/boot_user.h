@@ -35,7 +35,9 @@
 
 
 // UART communication baud rate, in Hz
+#ifndef UART_BAUD_RATE
 #define UART_BAUD_RATE 57600
+#endif
 
 // remappable pin for UART input
 #define RX_PIN 6
@@ -56,14 +58,24 @@
  * A value of 0x80 should work on all microcontrollers.  Larger values will
  * allow faster programming operations, but will consume more RAM.
  */
+#ifndef MAX_PROG_SIZE
 #define MAX_PROG_SIZE 0x80
-#define APPLICATION_START_ADDRESS 0x1000
+#endif
+#define APPLICATION_START_ADDRESS 0x2000
 #define TIME_PER_TMR2_50k 0.213
 #define FCY 16000000UL  /* instruction clock frequency, in Hz */
 
 #define _FLASH_PAGE   512  /* _FLASH_PAGE should be the maximum page (in instructions) */
 #define _FLASH_ROW    64  /* _FLASH_ROW = maximum write row (in instructions) */
 
+/* CW3 to CW1 are the last three instructions of program memory, so their
+ * page is left out of CMD_ERASE_RANGE */
+#define CONFIG_PAGE_ADDRESS (__PROGRAM_LENGTH - (_FLASH_PAGE << 1))
+
+/* the U1RX slot of the alternate interrupt vector table, which 
+ * BOOT_RX_INTERRUPT takes for the bootloader */
+#define U1RX_AIVT_ADDRESS 0x12a
+
 #define NUM_OF_TMR2_OVERFLOWS (uint16_t)((BOOT_LOADER_TIME/TIME_PER_TMR2_50k) + 1.0)
 
 #if defined(__PIC24FJ256GB106__)
@@ -105,6 +117,21 @@ bool should_abort_boot(uint16_t counterValue);
  */
 uint32_t readAddress(uint32_t address);
 
+/**
+ * @brief reads consecutive instructions, starting at the address
+ * @param address the starting address (must be even)
+ * @param words the buffer that receives the instructions
+ * @param count the number of instructions to read
+ */
+void readBlock(uint32_t address, uint32_t* words, uint16_t count);
+
+/**
+ * @brief reads the free-running 32-bit timer that BOOT_STATS and BOOT_TRACE
+ * measure with, which counts instruction cycles
+ * @return the count
+ */
+uint32_t statsTimer(void);
+
 /**
  * @brief erases the flash page starting at the address
  * @param address
@@ -134,12 +161,4 @@ void doubleWordWrite(uint32_t address, uint32_t* progDataArray);
  */
 void writeRow(uint32_t address, uint32_t* words);
 
-/**
- * @brief writes the maximum number of instructions
- * @param address the starting address
- * @param progData a 32-bit, 2-element array containing the instruction words
- * to be written to flash
- */
-void writeMax(uint32_t address, uint32_t* progData);
-
 #endif
\ No newline at end of file
@@ -1,5 +1,12 @@
 #include "xc.h"
 #include "boot_user.h"
+#include "bootloader.h"
+
+bool readBootPin(void);
+
+#if defined(BOOT_STATS) || defined(BOOT_TRACE)
+#error "BOOT_STATS and BOOT_TRACE need a 32-bit timer, which this port doesn't provide"
+#endif
 
 void initOsc(void){
     CLKDIV = 0;
@@ -10,6 +17,18 @@ void initOsc(void){
     return;
 }
 
+void initPins(void){
+#if defined(BOOT_PORT_A)
+    TRISA |= (1 << BOOT_PIN);
+    ANSELA &= ~(1 << BOOT_PIN);
+#elif defined(BOOT_PORT_B)
+    TRISB |= (1 << BOOT_PIN);
+    ANSELB &= ~(1 << BOOT_PIN);
+#else
+#error "boot port not specified or invalid"
+#endif
+}
+
 void initUart(void){
     U1MODE = 0;
     U1STA = 0x2000;
@@ -18,7 +37,13 @@ void initUart(void){
     /*           instFreq                           */
     /*  BRG = --------------- - 1                   */
     /*        (16 * baudRate)                       */
-    U1BRG = 12;     // assumes 12MIPS, 57600baud
+    if (UART_BAUD_RATE < FCY/4.0f){
+        U1MODEbits.BRGH = 0;
+        U1BRG = FCY / (16.0f*UART_BAUD_RATE) - 1;
+    } else {
+        U1MODEbits.BRGH = 1;
+        U1BRG = FCY / (4.0f*UART_BAUD_RATE) - 1;
+    }
     
     /* make the RX pin an input */
     #if defined RX_PORT_A
@@ -93,3 +118,47 @@ bool readBootPin(void){
 #error "boot port not specified"
 #endif
 }
+
+bool should_abort_boot(uint16_t counterValue){
+    if(counterValue > NUM_OF_TMR2_OVERFLOWS){
+        return true;
+    }
+
+    return readBootPin();
+}
+
+/* loads every write latch of the row that holds the address, with the count
+ * instructions at the address and 0xffffff elsewhere, and programs the row; 
+ * a latch left erased leaves its instruction as it was */
+static void writeLatches(uint32_t address, uint32_t* words, uint16_t count){
+    uint16_t i;
+    uint16_t tempTblPag = TBLPAG;
+    uint16_t offset = (uint16_t)(address & 0x0000ffc0);
+    uint16_t first = (uint16_t)((address & 0x0000003e) >> 1);
+    uint32_t instruction;
+    TBLPAG = (uint16_t)((address & 0x00ff0000) >> 16); /* initialize PM Page Boundary */
+
+    NVMCON = 0x4004; // Memory row program operation (32 instructions)
+    for (i=0; i<_FLASH_ROW; i++){
+        instruction = ((i >= first) && (i < first + count)) ? words[i - first] : 0xffffff;
+        __builtin_tblwtl(offset + i*2, (uint16_t)((instruction & 0x0000ffff) >> 0));
+        __builtin_tblwth(offset + i*2, (uint16_t)((instruction & 0x00ff0000) >> 16));
+    }
+    __builtin_disi(5);
+    __builtin_write_NVM();
+    nvmWait();
+
+    TBLPAG = tempTblPag;
+}
+
+void writeInstr(uint32_t address, uint32_t instruction){
+    writeLatches(address, &instruction, 1);
+}
+
+void writeRow(uint32_t address, uint32_t* words){
+    writeLatches(address & ~((uint32_t)(_FLASH_ROW << 1) - 1), words, _FLASH_ROW);
+}
+
+void doubleWordWrite(uint32_t address, uint32_t* progDataArray){
+    writeLatches(address, progDataArray, 2);
+}
@@ -39,11 +39,17 @@
 #define TX_PORT_B 
 #define TX_PIN 7
 
+// UART communication baud rate, in Hz
+#ifndef UART_BAUD_RATE
+#define UART_BAUD_RATE 57600
+#endif
+
 /**
  * @brief this is an approximation of the time that the bootloader will remain
  * active at startup before moving on to the application
  */
 #define BOOT_LOADER_TIME (10.0)
+#define STALE_MESSAGE_TIME (0.05f)
 
 /* @brief this is the maximum size that can be programmed into the microcontroller
  * as part of one transaction using the CMD_WRITE_MAX_PROG_SIZE command 
@@ -51,15 +57,23 @@
  * A value of 0x80 should work on all microcontrollers.  Larger values will
  * allow faster programming operations, but will consume more RAM.
  */
+#ifndef MAX_PROG_SIZE
 #define MAX_PROG_SIZE 0x80
+#endif
 
 /* @brief this is the starting address of the application - must be 
  * on an even erase page boundary
  */
+#define APPLICATION_START_ADDRESS 0x1800
+#define FCY 12000000UL  /* instruction clock frequency, in Hz */
 
 /* _FLASH_PAGE should be the maximum erase page (in instructions) */
 #define _FLASH_PAGE 128
-#define _FLASH_ROW 32
+#define _FLASH_ROW 32   /* _FLASH_ROW = write row, the 32 write latches (in instructions) */
+
+/* the U1RX slot of the alternate interrupt vector table, which 
+ * BOOT_RX_INTERRUPT takes for the bootloader */
+#define U1RX_AIVT_ADDRESS 0x12a
 
 #define ANSELA ANSA
 #define ANSELB ANSB
@@ -68,4 +82,99 @@
 #define TIME_PER_TMR2_50k 0.213
 #define NUM_OF_TMR2_OVERFLOWS (uint16_t)((BOOT_LOADER_TIME/TIME_PER_TMR2_50k) + 1.0)
 
+#if defined(__PIC24FV16KM202__)
+#define PLATFORM_STRING "pic24fv16km202"
+#else 
+#warning "your device may not be supported"
+#endif
+
+/**
+ * @brief initializes the oscillator
+ */
+void initOsc(void);
+
+/**
+ * @brief initializes the pins
+ */
+void initPins(void);
+
+/**
+ * @brief initializes the UART
+ */
+void initUart(void);
+
+/**
+ * @brief initializes TMR1 and the CCP1 timer that stands in for TMR2
+ */
+void initTimers(void);
+
+/**
+ * @brief determines if the bootloader should abort
+ * @return true if the bootloader should abort, else false
+ */
+bool should_abort_boot(uint16_t counterValue);
+
+/**
+ * @brief reads the value at the address
+ * @param address
+ * @return the value of the address
+ */
+uint32_t readAddress(uint32_t address);
+
+/**
+ * @brief reads consecutive instructions, starting at the address
+ * @param address the starting address (must be even)
+ * @param words the buffer that receives the instructions
+ * @param count the number of instructions to read
+ */
+void readBlock(uint32_t address, uint32_t* words, uint16_t count);
+
+/**
+ * @brief reads the free-running 32-bit timer that BOOT_STATS and BOOT_TRACE
+ * measure with, which counts instruction cycles
+ * 
+ * This port has no 32-bit timer to spare, so only the simulator provides it.
+ * 
+ * @return the count
+ */
+uint32_t statsTimer(void);
+
+/**
+ * @brief erases the flash page (4 rows) starting at the address
+ * @param address
+ */
+void eraseByAddress(uint32_t address);
+
+/**
+ * @brief writes one instruction, at the address
+ * 
+ * The flash has no word programming, so this is a row write with every
+ * other latch left erased.  It takes as long as writeRow().
+ * 
+ * @param address the address of the instruction (must be even)
+ * @param instruction the instruction to write
+ */
+void writeInstr(uint32_t address, uint32_t instruction);
+
+/**
+ * @brief writes two instructions, starting at the address
+ * 
+ * Like writeInstr(), this is a row write with the other latches left erased.
+ * 
+ * @param address the starting address (must be even)
+ * @param progDataArray a 32-bit, 2-element array containing the instruction 
+ * words to be written to flash
+ */
+void doubleWordWrite(uint32_t address, uint32_t* progDataArray);
+
+/**
+ * @brief writes an entire row of instructions, starting at the address
+ * 
+ * All 32 write latches are loaded and programmed in one NVM cycle.
+ * 
+ * @param address the starting address (must start a flash row)
+ * @param words a buffer containing the instructions to write
+ */
+void writeRow(uint32_t address, uint32_t* words);
+
 #endif
\ No newline at end of file
@@ -5,6 +5,7 @@
 
     .text
     .global _readAddress
+    .global _readBlock
     .global _eraseByAddress
     .global _startApp
     
@@ -28,6 +29,34 @@ _readAddress:
     
     return
     
+_readBlock:
+    ; on entry, address is contained within [W1:W0], the buffer within W2,
+    ; and the number of instructions within W3
+    push    TBLPAG
+    mov	    W1, TBLPAG
+    
+    cp0	    W3
+    bra	    z, read_block_done
+    
+read_block_loop:
+    ; the low word and the zero-extended high byte of each instruction
+    tblrdl  [W0], [W2++]
+    tblrdh  [W0++], [W2++]
+    
+    ; carry into the next page of program memory
+    cp0	    W0
+    bra	    nz, read_block_next
+    inc	    TBLPAG
+    
+read_block_next:
+    dec	    W3, W3
+    bra	    nz, read_block_loop
+    
+read_block_done:
+    pop	    TBLPAG
+    
+    return
+    
 _eraseByAddress:
     push    TBLPAG
     
@@ -46,6 +75,9 @@ _eraseByAddress:
     nop
     nop
     
+    ; empty the UART once the erase is done
+    call    _nvmWait
+    
     pop	    TBLPAG
     
     return
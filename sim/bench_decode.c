@@ -0,0 +1,237 @@
+/// Host benchmark of the receive path: the frame decoder in bootloader.c
+/// against the rescan-and-copy parser that it replaced, and in FRAMING_COBS.
+/// The times are of the host CPU, so they only compare the parsers with each
+/// other; the device runs them at a small fraction of the speed.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+/* the bootloader is built into the benchmark so that the decoder runs with
+ * its own buffer sizes and state */
+#define main bootloaderMain
+#include "../bootloader.c"
+#undef main
+
+/* the longest a frame can be once every byte has been escaped */
+#define WIRE_BUF_LEN    ((RX_BUF_LEN * 2) + 2)
+
+/* how long each parser is run for */
+#define BENCH_TIME_NS   300000000ULL
+
+static uint8_t message[RX_BUF_LEN];
+static uint16_t messageLength = 0;
+
+static uint8_t wire[WIRE_BUF_LEN];
+static uint16_t wireLength = 0;
+
+static uint8_t legacyBuffer[WIRE_BUF_LEN];
+static uint16_t legacyIndex = 0;
+
+static uint64_t nanoseconds(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t ticks(void){
+#if defined(HAVE_TSC)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void wireByte(uint8_t byte){
+    if((byte == START_OF_FRAME) || (byte == END_OF_FRAME) || (byte == ESC)){
+        wire[wireLength++] = ESC;
+        byte ^= ESC_XOR;
+    }
+    wire[wireLength++] = byte;
+}
+
+/* builds a CMD_WRITE_MAX_PROG_SIZE message of random instructions */
+static void buildMessage(void){
+    uint16_t length = 0, i, fletcher;
+
+    message[length++] = 0;
+    message[length++] = 0;
+    message[length++] = CMD_WRITE_MAX_PROG_SIZE;
+    for(i=0; i<4; i++)
+        message[length++] = (uint8_t)(0x1000 >> (i * 8));
+    for(i=0; i<MAX_PROG_SIZE; i++){
+        message[length++] = (uint8_t)rand();
+        message[length++] = (uint8_t)rand();
+        message[length++] = (uint8_t)rand();
+        message[length++] = 0;
+    }
+    
+    /* the length field counts the payload, after the length and command */
+    message[0] = (uint8_t)((length - 3) & 0xff);
+    message[1] = (uint8_t)((length - 3) >> 8);
+
+    fletcher = fletcher16(message, length);
+    message[length++] = (uint8_t)(fletcher & 0xff);
+    message[length++] = (uint8_t)(fletcher >> 8);
+    messageLength = length;
+}
+
+/* frames the message as the host would send it */
+static void buildFrame(void){
+    uint16_t i;
+    
+    wireLength = 0;
+    wire[wireLength++] = START_OF_FRAME;
+    for(i=0; i<messageLength; i++)
+        wireByte(message[i]);
+    wire[wireLength++] = END_OF_FRAME;
+}
+
+/* the same in COBS, where each block's code is filled in once the block
+ * ends */
+static void buildCobsFrame(void){
+    uint16_t i, code = 0;
+    uint8_t run = 1;
+
+    wireLength = 1;
+    for(i=0; i<messageLength; i++){
+        if(message[i] != 0){
+            wire[wireLength++] = message[i];
+            if(++run < 0xff)
+                continue;
+        }
+        wire[code] = run;
+        code = wireLength++;
+        run = 1;
+    }
+    wire[code] = run;
+    wire[wireLength++] = 0;
+}
+
+/* the parser that processReceived() used to run on every pass of the main
+ * loop: the whole buffer is searched for the start and end of frame, and a
+ * complete frame is unescaped into a copy before its checksum is taken */
+static bool legacyReceived(void){
+    bool startFound = false, endFound = false;
+    uint16_t indexOfStart = 0, indexOfEnd = 0;
+    uint16_t index = 0, messageIndex = 0;
+    uint8_t message[WIRE_BUF_LEN];
+    uint16_t fletcher;
+    bool escapeNext = false;
+
+    while(index < legacyIndex){
+        if(legacyBuffer[index] == START_OF_FRAME){
+            startFound = true;
+            indexOfStart = index;
+        }
+        index++;
+
+        if(startFound) break;
+    }
+
+    while(index < legacyIndex){
+        if(legacyBuffer[index] == END_OF_FRAME){
+            endFound = true;
+            indexOfEnd = index;
+        }
+        index++;
+
+        if(endFound) break;
+    }
+
+    if(!(startFound && endFound))
+        return false;
+
+    for(index=indexOfStart+1; index<indexOfEnd; index++){
+        if(!escapeNext){
+            if(legacyBuffer[index] == ESC){
+                escapeNext = true;
+            }else{
+                message[messageIndex] = legacyBuffer[index];
+                messageIndex++;
+            }
+        }else{
+            message[messageIndex] = legacyBuffer[index] ^ ESC_XOR;
+            messageIndex++;
+            escapeNext = false;
+        }
+    }
+
+    fletcher = (uint16_t)message[messageIndex - 2]
+            + ((uint16_t)message[messageIndex - 1] << 8);
+
+    legacyIndex = 0;
+    return fletcher == fletcher16(message, messageIndex - 2);
+}
+
+static bool legacyFrame(void){
+    bool valid = false;
+    uint16_t i;
+
+    for(i=0; i<wireLength; i++){
+        legacyBuffer[legacyIndex++] = wire[i];
+        valid |= legacyReceived();
+    }
+
+    return valid;
+}
+
+/* decodes the frame, with the length check that processReceived() makes 
+ * once it is complete */
+static bool decodeFrame(void){
+    bool valid = false;
+    uint16_t i;
+
+    for(i=0; i<wireLength; i++){
+        if(decodeByte(wire[i]) && (rxFrameStatus == STATUS_OK))
+            valid = ((uint16_t)rxBuffer[0] + ((uint16_t)rxBuffer[1] << 8) + 5 == rxBufferIndex);
+    }
+
+    return valid;
+}
+
+static void run(const char* name, bool (*parse)(void)){
+    uint64_t start = nanoseconds(), startTicks = ticks(), elapsed;
+    uint32_t frames = 0, rejected = 0;
+
+    do{
+        if(!parse())
+            rejected++;
+        frames++;
+        elapsed = nanoseconds() - start;
+    }while(elapsed < BENCH_TIME_NS);
+
+    printf("  %-8s %10.1f host ns/frame %7.2f host ns/byte", name,
+            (double)elapsed / frames, (double)elapsed / frames / wireLength);
+#if defined(HAVE_TSC)
+    printf(" %10.0f host tsc/frame", (double)(ticks() - startTicks) / frames);
+#else
+    (void)startTicks;
+#endif
+    printf("%s\n", rejected ? "  (frames rejected!)" : "");
+}
+
+int main(void){
+    srand(1);
+    buildMessage();
+    buildFrame();
+
+    printf("MAX_PROG_SIZE=0x%x RX_BUF_LEN=%u frame=%u bytes on the wire, timed on the host\n",
+            MAX_PROG_SIZE, RX_BUF_LEN, wireLength);
+    run("rescan", legacyFrame);
+    run("decoder", decodeFrame);
+
+    framing = FRAMING_COBS;
+    buildCobsFrame();
+    printf("  in COBS, frame=%u bytes on the wire\n", wireLength);
+    run("cobs", decodeFrame);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Compares the bytes on the wire per image with escaping and with COBS framing.
+
+Each image is split into frames the way loader.py splits it and encoded as
+the 3-byte packed sequenced writes that carry it to the device, and as the
+CMD_READ_RANGE replies that carry it back.  Every frame is measured
+complete, start and end bytes or delimiter included.  Hex files given on
+the command line are measured as they are; without any, three generated
+images are: the one loader.py uses for timing, whose operands are random,
+one closer to compiled code, with skewed register and literal fields,
+repeated prologues and calls, constant tables and strings, and the padding
+around sections, and one made of nothing but the bytes that escaping has
+to double, which is its worst case.
+
+    ./bench_framing.py
+    ./bench_framing.py app.hex --transfer 256 --row 64
+"""
+
+import argparse
+import random
+
+import loader
+
+
+def compiled_image(size, start, seed=1):
+    """Builds an image shaped like XC16 output, filling about `size` bytes of
+    flash (3 bytes per instruction)."""
+    rng = random.Random(seed)
+    image = {0: 0x040000 | start, 2: 0x000000}
+    for address in range(4, 0x200, 2):
+        image[address] = start + 0x10
+
+    def reg():
+        return min(int(rng.expovariate(0.5)), 15)
+
+    def ram():
+        return 0x800 + 2 * int(rng.expovariate(0.02))
+
+    functions = []
+    address = start
+    end = start + (size // 3) * 2
+
+    def emit(word):
+        nonlocal address
+        image[address] = word & 0xffffff
+        address += 2
+
+    while address < end:
+        kind = rng.random()
+        if kind < 0.08:
+            # a constant table or string, padded to an even address
+            if rng.random() < 0.5:
+                text = bytes(rng.choice(b'etaoin shrdlu:%d\r\n') for _ in range(rng.randrange(8, 48)))
+                for i in range(0, len(text), 2):
+                    emit(text[i] | ((text[i + 1] if i + 1 < len(text) else 0) << 8))
+            else:
+                for _ in range(rng.randrange(8, 64)):
+                    emit(int(rng.expovariate(0.01)) & 0xffff)
+            continue
+
+        # a function: prologue, body, epilogue
+        functions.append(address)
+        emit(0xfa0000 | (2 * rng.randrange(0, 8)))                 # lnk #n
+        for _ in range(rng.randrange(0, 4)):
+            emit(0x781f80 | reg())                                  # mov wn, [w15++]
+        for _ in range(rng.randrange(8, 80)):
+            op = rng.random()
+            if op < 0.25:
+                emit(0x780000 | (reg() << 7) | reg())               # mov ws, wd
+            elif op < 0.40:
+                emit(0x200000 | (int(rng.expovariate(0.05)) << 4) | reg())   # mov #lit, wn
+            elif op < 0.55:
+                emit(rng.choice((0x800000, 0x880000)) | (ram() << 3) | reg())  # mov f <-> wn
+            elif op < 0.65:
+                emit(rng.choice((0x400000, 0x500000)) | (reg() << 15) | (reg() << 7) | reg())
+            elif op < 0.75 and functions:
+                target = rng.choice(functions[-20:])
+                emit(0x020000 | (target & 0xffff))                  # call
+                emit(target >> 16)
+            elif op < 0.88:
+                emit(rng.choice((0x320000, 0x3a0000, 0x370000)) | int(rng.expovariate(0.1)))
+            else:
+                emit(rng.choice((0xe00000, 0xe80000, 0xa90000)) | (ram() << 1))
+        for _ in range(rng.randrange(0, 4)):
+            emit(0x78004f | (reg() << 7))                           # mov [--w15], wn
+        emit(0xfa8000)                                              # ulnk
+        emit(0x060000)                                              # return
+
+        # sections are aligned, leaving the rest of the row erased
+        if rng.random() < 0.05:
+            address += 2 * rng.randrange(0, 64)
+    return image
+
+
+def special_image(size, start):
+    """An image whose every byte has to be escaped."""
+    specials = (loader.START_OF_FRAME, loader.END_OF_FRAME, loader.ESC)
+    image = {}
+    for i in range(size // 3):
+        image[start + 2 * i] = (specials[i % 3] | (specials[(i + 1) % 3] << 8)
+                                | (specials[(i + 2) % 3] << 16))
+    return image
+
+
+def wire_bytes(frames, framing):
+    """The bytes on the wire for each encoding of the frames."""
+    packed = replies = 0
+    for seq, (address, words) in enumerate(frames.items()):
+        data = loader.pack_words(words)
+        header = loader.u16(seq & 0xffff) + loader.u32(address)
+        packed += len(loader.encode_frame(loader.CMD_WRITE_MAX_PACKED, header + data, framing))
+        replies += len(loader.encode_frame(loader.CMD_READ_RANGE,
+                                           loader.u32(address) + data, framing))
+    return packed, replies
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('hexfiles', nargs='*')
+    parser.add_argument('--transfer', type=int, default=0x80,
+                        help='MAX_PROG_SIZE of the device, in instructions')
+    parser.add_argument('--row', type=int, default=64, help='_FLASH_ROW of the device')
+    parser.add_argument('--app-start', type=lambda x: int(x, 0), default=0x2000)
+    parser.add_argument('--boot-start', type=lambda x: int(x, 0), default=0x400)
+    parser.add_argument('--size', type=int, default=24000,
+                        help='bytes of flash filled by the generated images')
+    args = parser.parse_args()
+
+    if args.hexfiles:
+        images = [(path, loader.read_hex(path)) for path in args.hexfiles]
+    else:
+        images = [('random operands', loader.synthetic_image(args.size, args.app_start)),
+                  ('compiled-like', compiled_image(args.size, args.app_start)),
+                  ('all escaped', special_image(args.size, args.app_start))]
+
+    size = max(args.row, args.transfer - args.transfer % args.row)
+    print('{:<20} {:<10} {:>10} {:>10} {:>8}'.format('image', 'encoding', 'escaped', 'cobs', 'saved'))
+    for name, image in images:
+        frames = {address: words for address, words in loader.chunks(image, size).items()
+                  if not args.boot_start <= address < args.app_start}
+        escaped = wire_bytes(frames, loader.FRAMING_ESCAPED)
+        cobs = wire_bytes(frames, loader.FRAMING_COBS)
+        for kind, before, after in zip(('packed', 'read back'), escaped, cobs):
+            print('{:<20} {:<10} {:>10} {:>10} {:>7.1f}%'.format(
+                name, kind, before, after, 100.0 * (before - after) / before))
+            name = ''
+
+
+if __name__ == '__main__':
+    main()
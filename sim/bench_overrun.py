@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Counts the receive overruns of the polled and interrupt builds at 1 Mbaud.
+
+Each stress sends a command that keeps the device busy for a while, with a
+burst of CMD_READ_DESCRIPTOR frames straight behind it in the same write, so
+that the burst arrives while the command runs.  The polled bootloader only
+empties the UART between commands, while it waits on the UART or on the
+flash, and between the blocks of a CRC, so the 4-byte FIFO overruns under a
+blank check; the RXINT=1 build empties it from the U1RX interrupt instead.  A page erase
+stalls the CPU, interrupts and all, so neither build keeps up with it.
+The default burst fits in RX_RING_LEN; a longer one fills the ring under the
+interrupt build, and the bytes beyond it are counted as dropped.
+
+    for device in pic24fj256gb106 pic24fvXkm; do
+        make DEVICE=$device BAUD=1000000
+        make DEVICE=$device BAUD=1000000 RXINT=1
+    done
+    ./bench_overrun.py
+"""
+
+import argparse
+import os
+
+import loader
+
+DEVICES = ('pic24fj256gb106', 'pic24fvXkm')
+BAUD = 1000000
+
+
+def crc_stress(dev):
+    """A CRC over the whole application space."""
+    count = (dev.prog_len - dev.app_start) // 2
+    return loader.encode_frame(loader.CMD_READ_CRC, loader.u32(dev.app_start) + loader.u32(count))
+
+
+def blank_stress(dev):
+    """An erase of blank pages, which are only read and skipped."""
+    end = dev.app_start + 8 * 2 * dev.page_len
+    return loader.encode_frame(loader.CMD_ERASE_RANGE, loader.u32(dev.app_start) + loader.u32(end))
+
+
+def erase_stress(dev):
+    """An erase of a page that has been programmed."""
+    dev.write_row(dev.app_start, [0] * dev.row_len)
+    end = dev.app_start + 2 * dev.page_len
+    return loader.encode_frame(loader.CMD_ERASE_RANGE, loader.u32(dev.app_start) + loader.u32(end))
+
+
+STRESSES = (('crc', crc_stress), ('blank erase', blank_stress), ('page erase', erase_stress))
+
+
+def measure(path, stress, burst):
+    """Returns the replies to the burst that arrived, and the overruns and
+    bytes dropped that the device counted."""
+    sim = loader.Simulator(path, fast=True)
+    dev = loader.Device(loader.Port(sim.pty), sim.baud)
+    dev.identify()
+    frames = stress(dev) + loader.encode_frame(loader.CMD_READ_DESCRIPTOR) * burst
+    before = dev.read_rx_errors()
+
+    dev.port.write(frames)
+    replies = 0
+    while True:
+        try:
+            cmd, _ = dev.receive(timeout=0.5)
+        except loader.ProtocolError:
+            break
+        if cmd == loader.CMD_READ_DESCRIPTOR:
+            replies += 1
+
+    after = dev.read_rx_errors()
+    dev.start_app()
+    sim.finish()
+    return replies, after[0] - before[0], after[1] - before[1]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('devices', nargs='*', default=DEVICES)
+    parser.add_argument('--burst', type=int, default=8,
+                        help='CMD_READ_DESCRIPTOR frames sent behind each stress')
+    args = parser.parse_args()
+
+    print('{:<18} {:<12} {:<10} {:>8} {:>9} {:>8}'.format(
+        'device', 'stress', 'receive', 'replies', 'overruns', 'dropped'))
+    for device in args.devices:
+        for name, stress in STRESSES:
+            for mode, suffix, flags in (('polled', '', ''), ('interrupt', '-rxint', ' RXINT=1')):
+                path = os.path.join('build', '{}-{}{}'.format(device, BAUD, suffix), 'bootypic-sim')
+                if not os.path.exists(path):
+                    print('{:<18} {:<12} {:<10} not built, run "make DEVICE={} BAUD={}{}"'.format(
+                        device, name, mode, device, BAUD, flags))
+                    continue
+                replies, overruns, dropped = measure(path, stress, args.burst)
+                print('{:<18} {:<12} {:<10} {:>5}/{:<2} {:>9} {:>8}'.format(
+                    device, name, mode, replies, args.burst, overruns, dropped))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Measures the instructions programmed per second on each simulated device.
+
+Each device is loaded with the same generated image through
+CMD_WRITE_MAX_PACKED, and the programming time is taken from its own
+CMD_READ_STATS counters, so the simulators have to be built with STATS=1:
+
+    for device in dspic33epXmc/32mc204 dspic33epXmc/64mc504 pic24fj256gb106 pic24fvXkm; do
+        make DEVICE=$device STATS=1
+    done
+    ./bench_program.py
+
+"programming" counts only the time spent in writeRow() and doubleWordWrite(),
+which is what the device port decides; "end to end" is the whole load at the
+device's UART_BAUD_RATE, erases and the link included.
+
+--words measures the PIC24F ports again with their rows programmed one
+instruction at a time, from the simulators built with WORDS=1 as well:
+
+    make DEVICE=pic24fvXkm STATS=1 WORDS=1
+    ./bench_program.py --words pic24fj256gb106 pic24fvXkm
+"""
+
+import argparse
+import os
+
+import loader
+
+DEVICES = ('dspic33epXmc/32mc204', 'dspic33epXmc/64mc504', 'pic24fj256gb106', 'pic24fvXkm')
+
+
+def measure(path, size):
+    sim = loader.Simulator(path, fast=True)
+    dev = loader.Device(loader.Port(sim.pty), sim.baud)
+    dev.identify()
+
+    # leave room for the image in the smallest parts
+    room = (dev.prog_len - dev.app_start - 2 * dev.page_len) * 3 // 2
+    image = loader.synthetic_image(min(size, room), dev.app_start)
+    loader.load(dev, image, 0, 0, write_max=True, verify=False, window=1, packed=True,
+                log=lambda *args: None)
+    stats = dev.read_stats()
+    dev.start_app()
+    summary = sim.finish()
+
+    programming = stats['nvm']['row'][1] + stats['nvm']['double word'][1]
+    return dev, int(summary['words']), programming, float(summary['session'])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('devices', nargs='*', default=DEVICES)
+    parser.add_argument('--size', type=int, default=30000,
+                        help='bytes of flash filled by the generated image, where it fits')
+    parser.add_argument('--words', action='store_true',
+                        help='also measure the WORDS=1 builds, which program a word at a time')
+    args = parser.parse_args()
+
+    builds = [('row', '-stats', '')]
+    if args.words:
+        builds.append(('word', '-stats-words', ' WORDS=1'))
+
+    print('{:<22} {:>5} {:>5} {:>8} {:>12} {:>14} {:>14}'.format(
+        'device', 'row', 'write', 'instrs', 'programming', 'instr/s', 'end to end'))
+    for device in args.devices:
+        for write, suffix, flags in builds:
+            if write == 'word' and not device.startswith('pic24f'):
+                # the dsPIC33E ports already program a double word at a time
+                continue
+            path = os.path.join('build', os.path.basename(device) + suffix, 'bootypic-sim')
+            if not os.path.exists(path):
+                print('{:<22} {:>5} {:>5} not built, run "make DEVICE={} STATS=1{}"'.format(
+                    device, '', write, device, flags))
+                continue
+            dev, words, programming, session = measure(path, args.size)
+            print('{:<22} {:>5} {:>5} {:>8} {:>11.3f}s {:>14.0f} {:>14.0f}'.format(
+                device, dev.row_len, write, words, programming, words / programming, words / session))
+
+
+if __name__ == '__main__':
+    main()
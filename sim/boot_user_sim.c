@@ -0,0 +1,155 @@
+/// Simulated implementation of the device-specific bootloader operations
+#include "xc.h"
+#include "bootloader.h"
+#include "sim.h"
+
+/* typical NVM operation times from the datasheet electrical characteristics,
+ * in microseconds; the CPU is stalled for the duration of each operation */
+#if defined(__dsPIC33E__)
+#define PAGE_ERASE_TIME         20000
+#define DOUBLE_WORD_WRITE_TIME  47
+#elif defined(__PIC24FJ256GB106__)
+#define PAGE_ERASE_TIME         20000
+#define ROW_WRITE_TIME          1600
+#define WORD_WRITE_TIME         40
+#elif defined(__PIC24FV16KM202__)
+#define PAGE_ERASE_TIME         2000
+#define ROW_WRITE_TIME          2000
+#endif
+
+void initOsc(void){
+    return;
+}
+
+void initPins(void){
+    return;
+}
+
+void initUart(void){
+    /* use the same baud rate generator settings as the device port so that
+     * the character time on the wire matches */
+#if defined(UART_BAUD_RATE)
+    if (UART_BAUD_RATE < FCY/4.0f){
+        U1MODEbits.BRGH = 0;
+        U1BRG = FCY / (16.0f*UART_BAUD_RATE) - 1;
+    }else{
+        U1MODEbits.BRGH = 1;
+        U1BRG = FCY / (4.0f*UART_BAUD_RATE) - 1;
+    }
+#else
+    U1MODEbits.BRGH = 0;
+    U1BRG = 12;
+#endif
+
+    simUartInit();
+}
+
+void initTimers(void){
+    simTimersInit(0x0030, 0x8030);
+}
+
+uint32_t statsTimer(void){
+    /* the two halves of timers 4 and 5 are read separately on the device */
+    simAdvance(2 * SIM_ACCESS_CYCLES);
+    return (uint32_t)simCycles;
+}
+
+bool should_abort_boot(uint16_t counterValue){
+    /* the boot pin is modeled as held low */
+    if(counterValue > NUM_OF_TMR2_OVERFLOWS){
+        return true;
+    }
+
+    return false;
+}
+
+uint32_t readAddress(uint32_t address){
+    return simFlashRead(address);
+}
+
+void readBlock(uint32_t address, uint32_t* words, uint16_t count){
+    uint16_t i;
+
+    for(i = 0; i < count; i++){
+        words[i] = simFlashRead(address + (i << 1));
+    }
+}
+
+void eraseByAddress(uint32_t address){
+    simFlashErase(address, PAGE_ERASE_TIME);
+    nvmWait();
+}
+
+#if defined(__dsPIC33E__)
+
+/* mirrors devices/dspic33epXmc */
+void doubleWordWrite(uint32_t address, uint32_t* progDataArray){
+    simFlashProgram(address, progDataArray, 2, DOUBLE_WORD_WRITE_TIME);
+    nvmWait();
+}
+
+void writeRow(uint32_t address, uint32_t words[_FLASH_ROW]){
+    uint16_t i;
+
+    for(i = 0; i < _FLASH_ROW; i += 2, address += 4){
+        if((address < __IVT_BASE)
+                || (((words[i] & words[i + 1]) & 0xffffff) == 0xffffff))
+            continue;
+
+        doubleWordWrite(address, &words[i]);
+    }
+}
+
+#else
+
+#if defined(__PIC24FV16KM202__)
+/* mirrors devices/pic24fvXkm, which has no word programming: each write is a
+ * row write, with the latches outside of the instructions left erased */
+void writeInstr(uint32_t address, uint32_t instruction){
+    simFlashProgram(address, &instruction, 1, ROW_WRITE_TIME);
+    nvmWait();
+}
+#else
+/* mirrors devices/pic24fj256gb106 */
+void writeInstr(uint32_t address, uint32_t instruction){
+    simFlashProgram(address, &instruction, 1, WORD_WRITE_TIME);
+    nvmWait();
+}
+#endif
+
+void writeRow(uint32_t address, uint32_t* words){
+    uint32_t rowAddress = address & ~((uint32_t)(_FLASH_ROW << 1) - 1);
+#if defined(SIM_WORD_WRITES)
+    uint16_t i;
+
+    /* what a port without row writes would do */
+    for(i = 0; i < _FLASH_ROW; i++){
+        if((words[i] & 0xffffff) != 0xffffff)
+            writeInstr(rowAddress + (i << 1), words[i]);
+    }
+#else
+    simFlashProgram(rowAddress, words, _FLASH_ROW, ROW_WRITE_TIME);
+    nvmWait();
+#endif
+}
+
+#if defined(__PIC24FV16KM202__)
+/* mirrors devices/pic24fvXkm, which latches both instructions and writes
+ * them with a single row cycle */
+void doubleWordWrite(uint32_t address, uint32_t* progDataArray){
+    simFlashProgram(address, progDataArray, 2, ROW_WRITE_TIME);
+    nvmWait();
+}
+#else
+void doubleWordWrite(uint32_t address, uint32_t* progDataArray){
+    writeInstr(address, progDataArray[0]);
+    writeInstr(address+2, progDataArray[1]);
+}
+#endif
+
+#endif
+
+void startApp(uint16_t applicationAddress){
+    (void)applicationAddress;
+    simExit(0);
+}
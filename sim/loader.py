@@ -0,0 +1,1147 @@
+#!/usr/bin/env python3
+"""Minimal bootypic host loader, used to exercise the simulator.
+
+This speaks the framed protocol described in bootloader.h.  It is not meant
+to replace booty; it exists so that a load can be run and timed against the
+simulator (or a board) from this repository.
+
+    ./loader.py --sim build/32mc204/bootypic-sim --synthetic 32768
+    ./loader.py --port /dev/ttyUSB0 app.hex
+"""
+
+import argparse
+import os
+import random
+import re
+import select
+import struct
+import subprocess
+import sys
+import termios
+import time
+import tty
+import zlib
+
+START_OF_FRAME = 0xf7
+END_OF_FRAME = 0x7f
+ESC = 0xf6
+ESC_XOR = 0x20
+
+# the framings that CMD_SET_FRAMING chooses between
+FRAMING_ESCAPED = 0x00
+FRAMING_COBS = 0x01
+
+STATUS_OK = 0x00
+STATUS_OUT_OF_ORDER = 0x01
+STATUS_CHECKSUM = 0x02
+STATUS_PROTECTED = 0x03
+STATUS_LENGTH = 0x04
+STATUS_UNKNOWN_COMMAND = 0x05
+STATUS_BAUD_RATE = 0x07
+STATUS_VERIFY = 0x08
+STATUS_FRAMING = 0x09
+
+# the capabilities in the CMD_READ_DESCRIPTOR reply
+CAP_RX_ERRORS = 1 << 0
+CAP_STATUS = 1 << 1
+CAP_SEQUENCED = 1 << 2
+CAP_PACKED = 1 << 4
+CAP_CRC = 1 << 5
+CAP_SET_BAUD = 1 << 6
+CAP_APP_RECORD = 1 << 7
+CAP_STATS = 1 << 8
+CAP_TRACE = 1 << 9
+CAP_READ_RANGE = 1 << 10
+CAP_COBS = 1 << 11
+CAP_ERASE_RANGE = 1 << 12
+CAP_READ_SKIPPED = 1 << 13
+CAP_RX_INTERRUPT = 1 << 14
+CAP_SESSION = 1 << 15
+
+# the U1RX slot of the alternate vector table, which the PIC24F ports keep
+# for the bootloader when built with BOOT_RX_INTERRUPT
+U1RX_AIVT_ADDRESS = 0x12a
+
+# the most records in a CMD_READ_TRACE reply
+TRACE_DUMP_LEN = 64
+
+# the flash operations in the CMD_READ_STATS reply, in order
+STATS_NVM = ('erase', 'double word', 'row')
+
+# longer than the device waits for a new baud rate or framing to be confirmed
+# (BAUD_CONFIRM_TIME), in whole TMR2 overflows
+BAUD_CONFIRM_WAIT = 1.0
+
+CMD_READ_PLATFORM = 0x00
+CMD_READ_VERSION = 0x01
+CMD_READ_ROW_LEN = 0x02
+CMD_READ_PAGE_LEN = 0x03
+CMD_READ_PROG_LEN = 0x04
+CMD_READ_MAX_PROG_SIZE = 0x05
+CMD_READ_APP_START_ADDR = 0x06
+CMD_READ_BOOT_START_ADDR = 0x07
+CMD_READ_RX_ERRORS = 0x08
+CMD_READ_DESCRIPTOR = 0x09
+CMD_READ_STATS = 0x0a
+CMD_READ_TRACE = 0x0b
+CMD_READ_SKIPPED = 0x0c
+CMD_ERASE_PAGE = 0x10
+CMD_ERASE_RANGE = 0x11
+CMD_READ_ADDR = 0x20
+CMD_READ_MAX = 0x21
+CMD_READ_MAX_PACKED = 0x22
+CMD_READ_CRC = 0x23
+CMD_READ_RANGE = 0x24
+CMD_WRITE_ROW = 0x30
+CMD_WRITE_MAX_PROG_SIZE = 0x31
+CMD_WRITE_SEQ_RESET = 0x32
+CMD_WRITE_ROW_SEQ = 0x33
+CMD_WRITE_MAX_SEQ = 0x34
+CMD_WRITE_ROW_PACKED = 0x36
+CMD_WRITE_MAX_PACKED = 0x37
+CMD_WRITE_APP_RECORD = 0x38
+CMD_WRITE_SESSION_OPEN = 0x39
+CMD_WRITE_SESSION = 0x3a
+CMD_WRITE_SESSION_CLOSE = 0x3b
+CMD_START_APP = 0x40
+CMD_STATUS = 0x50
+CMD_SET_BAUD = 0x60
+CMD_SET_FRAMING = 0x61
+
+
+class ProtocolError(Exception):
+    pass
+
+
+def fletcher16(data):
+    sum1 = sum2 = 0
+    for byte in data:
+        sum1 = (sum1 + byte) & 0xff
+        sum2 = (sum2 + sum1) & 0xff
+    return (sum2 << 8) | sum1
+
+
+def escape(data):
+    out = bytearray()
+    for byte in data:
+        if byte in (START_OF_FRAME, END_OF_FRAME, ESC):
+            out += bytes((ESC, byte ^ ESC_XOR))
+        else:
+            out.append(byte)
+    return out
+
+
+def cobs_encode(data):
+    """COBS, as frames are sent to the device: each block starts with one
+    more than the number of bytes before the zero that it stands for."""
+    out = bytearray((0,))
+    code = 0
+    for byte in data:
+        if byte:
+            out.append(byte)
+            if len(out) - code < 0xff:
+                continue
+        out[code] = len(out) - code
+        code = len(out)
+        out.append(0)
+    out[code] = len(out) - code
+    return out
+
+
+def rcobs_encode(data):
+    """The reverse of COBS that the device replies in, with each code byte
+    after its block, as the bootloader's txByte() produces it."""
+    out = bytearray()
+    run = 1
+    for byte in data:
+        if byte:
+            out.append(byte)
+            run += 1
+            if run < 0xff:
+                continue
+        out.append(run)
+        run = 1
+    out.append(run)
+    return out
+
+
+def rcobs_decode(raw):
+    """Decodes a reply from the end, returning None if it is malformed."""
+    out = bytearray()
+    end = len(raw)
+    while end:
+        code = raw[end - 1]
+        start = end - code
+        if code == 0 or start < 0:
+            return None
+        # the last code of the frame doesn't stand for a zero
+        if code != 0xff and end != len(raw):
+            out.append(0)
+        out += raw[start:end - 1][::-1]
+        end = start
+    return bytes(out[::-1])
+
+
+def encode_frame(cmd, payload=b'', framing=FRAMING_ESCAPED):
+    message = bytes((len(payload) & 0xff, len(payload) >> 8, cmd)) + bytes(payload)
+    checksum = fletcher16(message)
+    message += bytes((checksum & 0xff, checksum >> 8))
+    if framing == FRAMING_COBS:
+        return cobs_encode(message) + bytes((0,))
+    return bytes((START_OF_FRAME,)) + escape(message) + bytes((END_OF_FRAME,))
+
+
+def u16(value):
+    return bytes((value & 0xff, (value >> 8) & 0xff))
+
+
+def u32(value):
+    return bytes((value & 0xff, (value >> 8) & 0xff,
+                  (value >> 16) & 0xff, (value >> 24) & 0xff))
+
+
+def words_to_bytes(words):
+    return b''.join(u32(word) for word in words)
+
+
+def bytes_to_words(data):
+    return [int.from_bytes(data[i:i + 4], 'little') for i in range(0, len(data) - 3, 4)]
+
+
+def pack_words(words):
+    """Packs instructions into the 3 bytes each that the packed commands
+    carry, leaving out the phantom upper byte."""
+    return b''.join(bytes((w & 0xff, (w >> 8) & 0xff, (w >> 16) & 0xff)) for w in words)
+
+
+def write_hex(path, image):
+    """Writes {program address: instruction} as an XC16 Intel HEX file, the
+    way read_hex() reads it."""
+    def record(kind, offset, data):
+        line = bytes((len(data), offset >> 8, offset & 0xff, kind)) + bytes(data)
+        return ':{}{:02X}\n'.format(line.hex().upper(), -sum(line) & 0xff)
+
+    upper = None
+    with open(path, 'w') as hexfile:
+        for address, words in runs(image):
+            for i in range(0, len(words), 4):
+                byte_address = 2 * (address + 2 * i)
+                if byte_address >> 16 != upper:
+                    upper = byte_address >> 16
+                    hexfile.write(record(0x04, 0, u16(upper)[::-1]))
+                data = words_to_bytes(words[i:i + 4])
+                # a record can't run past the 64 kB boundary
+                room = 0x10000 - (byte_address & 0xffff)
+                hexfile.write(record(0x00, byte_address & 0xffff, data[:room]))
+                if room < len(data):
+                    upper += 1
+                    hexfile.write(record(0x04, 0, u16(upper)[::-1]))
+                    hexfile.write(record(0x00, 0, data[room:]))
+        hexfile.write(record(0x01, 0, b''))
+
+
+def read_hex(path):
+    """Reads an XC16 Intel HEX file into {program address: instruction}."""
+    memory = {}
+    upper = 0
+    with open(path) as hexfile:
+        for line in hexfile:
+            line = line.strip()
+            if not line.startswith(':'):
+                continue
+            record = bytes.fromhex(line[1:])
+            count, offset, kind = record[0], (record[1] << 8) | record[2], record[3]
+            data = record[4:4 + count]
+            if kind == 0x00:
+                base = upper + offset
+                for i, byte in enumerate(data):
+                    memory[base + i] = byte
+            elif kind == 0x04:
+                upper = ((data[0] << 8) | data[1]) << 16
+            elif kind == 0x01:
+                break
+
+    image = {}
+    for byte_address in sorted(memory):
+        address = (byte_address >> 1) & ~1
+        word = image.get(address, 0)
+        word |= memory[byte_address] << (8 * (byte_address & 3))
+        image[address] = word & 0xffffff
+    return image
+
+
+OPCODES = [0x780000, 0x200000, 0x400000, 0x500000, 0x880000, 0x800000,
+           0xe80000, 0x370000, 0x020000, 0x060000, 0x090000, 0xb00000]
+
+
+def synthetic_image(size, start, seed=1):
+    """Builds a repeatable image that looks roughly like XC16 output: an
+    interrupt vector table, code drawn from common opcodes, and constant
+    tables, filling `size` bytes of flash (3 bytes per instruction)."""
+    rng = random.Random(seed)
+    image = {0: 0x040000 | start, 2: 0x000000}
+    for address in range(4, 0x200, 2):
+        image[address] = start + 0x10
+    count = size // 3
+    address = start
+    while count > 0:
+        if rng.random() < 0.1:
+            length = min(count, rng.randrange(8, 64))
+            table = [rng.randrange(0, 0x10000) for _ in range(8)]
+            for i in range(length):
+                image[address] = table[i % len(table)]
+                address += 2
+        else:
+            length = min(count, rng.randrange(16, 128))
+            for _ in range(length):
+                image[address] = rng.choice(OPCODES) | rng.randrange(0, 0x10000)
+                address += 2
+        count -= length
+    return image
+
+
+class Port:
+    """A raw serial port or pseudo-terminal."""
+
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+
+    def write(self, data):
+        view = memoryview(data)
+        while view:
+            written = os.write(self.fd, view)
+            view = view[written:]
+
+    def set_baud(self, baud):
+        """Changes the rate of a serial port.  A pseudo-terminal ignores it,
+        and so does this for a rate that termios has no constant for."""
+        speed = getattr(termios, 'B{}'.format(baud), None)
+        if speed is None:
+            return
+        attrs = termios.tcgetattr(self.fd)
+        attrs[4] = attrs[5] = speed
+        termios.tcsetattr(self.fd, termios.TCSADRAIN, attrs)
+
+    def read(self, timeout):
+        ready, _, _ = select.select([self.fd], [], [], timeout)
+        if not ready:
+            return b''
+        return os.read(self.fd, 4096)
+
+    def close(self):
+        os.close(self.fd)
+
+
+class Device:
+    def __init__(self, port, baud, timeout=1.0):
+        self.port = port
+        self.baud = baud
+        self.timeout = timeout
+        self.pending = bytearray()
+        self.framing = FRAMING_ESCAPED
+        self.wire_tx = 0
+        self.wire_rx = 0
+        self.statuses = 0
+
+    def send(self, cmd, payload=b''):
+        """Sends a frame, returning the time it takes to cross the wire."""
+        frame = encode_frame(cmd, payload, self.framing)
+        self.wire_tx += len(frame)
+        self.port.write(frame)
+        return len(frame) * 10.0 / self.baud
+
+    def receive(self, timeout=None):
+        """Returns (cmd, payload) of the next valid frame."""
+        deadline = time.monotonic() + (self.timeout if timeout is None else timeout)
+        while True:
+            if self.framing == FRAMING_COBS:
+                end = self.pending.find(b'\0')
+                if end >= 0:
+                    raw = bytes(self.pending[:end])
+                    del self.pending[:end + 1]
+                    self.wire_rx += len(raw) + 1
+                    message = rcobs_decode(raw)
+                    frame = self._check(message) if message else None
+                    if frame is not None:
+                        return frame
+                    continue
+                start = -1
+            else:
+                start = self.pending.find(bytes((START_OF_FRAME,)))
+            if start >= 0:
+                end = self.pending.find(bytes((END_OF_FRAME,)), start)
+                if end >= 0:
+                    raw = bytes(self.pending[start + 1:end])
+                    del self.pending[:end + 1]
+                    self.wire_rx += len(raw) + 2
+                    frame = self._decode(raw)
+                    if frame is not None:
+                        return frame
+                    continue
+            remaining = deadline - time.monotonic()
+            if remaining <= 0:
+                raise ProtocolError('timed out waiting for a reply')
+            self.pending += self.port.read(remaining)
+
+    @staticmethod
+    def _decode(raw):
+        message = bytearray()
+        escape_next = False
+        for byte in raw:
+            if escape_next:
+                message.append(byte ^ ESC_XOR)
+                escape_next = False
+            elif byte == ESC:
+                escape_next = True
+            else:
+                message.append(byte)
+        return Device._check(message)
+
+    @staticmethod
+    def _check(message):
+        if len(message) < 5:
+            return None
+        checksum = message[-2] | (message[-1] << 8)
+        if checksum != fletcher16(message[:-2]):
+            return None
+        return message[2], bytes(message[3:-2])
+
+    def query(self, cmd, payload=b'', retries=2, timeout=None):
+        """Sends a command and returns the payload of its reply, resending
+        when the reply does not arrive or the frame is reported corrupt."""
+        for attempt in range(retries + 1):
+            self.send(cmd, payload)
+            try:
+                while True:
+                    reply_cmd, reply = self.receive(timeout)
+                    if reply_cmd == cmd:
+                        return reply
+                    if reply_cmd == CMD_STATUS:
+                        if reply[0] in (STATUS_CHECKSUM, STATUS_LENGTH):
+                            self.statuses += 1
+                            raise ProtocolError('frame corrupted on the way to the device')
+                        if reply[1] == cmd:
+                            raise ProtocolError('command 0x{:02x} refused with status {}'.format(
+                                cmd, reply[0]))
+            except ProtocolError:
+                if attempt == retries:
+                    raise
+
+    def read_string(self, cmd):
+        return self.query(cmd).rstrip(b'\0').decode()
+
+    def read_u16(self, cmd):
+        return int.from_bytes(self.query(cmd)[:2], 'little')
+
+    def read_u32(self, cmd):
+        return int.from_bytes(self.query(cmd)[:4], 'little')
+
+    def identify(self):
+        """Reads the parameters of the device, all at once with
+        CMD_READ_DESCRIPTOR if it has that, or else one at a time.  The
+        descriptor is asked for a second time before giving up on it, since
+        the first frame can arrive while the device is still programming its
+        U1RX vector after a reset."""
+        try:
+            reply = self.query(CMD_READ_DESCRIPTOR, retries=1)
+        except ProtocolError:
+            reply = None
+        if reply:
+            (_, self.row_len, self.page_len, self.prog_len, self.max_prog_size,
+             self.app_start, self.boot_start, self.rx_buf_len,
+             self.capabilities) = struct.unpack_from('<BHHIHIIHI', reply)
+            self.version = reply[25:41].rstrip(b'\0').decode()
+            self.platform = reply[41:61].rstrip(b'\0').decode()
+            return
+
+        self.rx_buf_len = None
+        self.capabilities = 0
+        self.platform = self.read_string(CMD_READ_PLATFORM)
+        self.version = self.read_string(CMD_READ_VERSION)
+        self.row_len = self.read_u16(CMD_READ_ROW_LEN)
+        self.page_len = self.read_u16(CMD_READ_PAGE_LEN)
+        self.prog_len = self.read_u32(CMD_READ_PROG_LEN)
+        self.max_prog_size = self.read_u16(CMD_READ_MAX_PROG_SIZE)
+        self.app_start = self.read_u16(CMD_READ_APP_START_ADDR)
+        self.boot_start = self.read_u16(CMD_READ_BOOT_START_ADDR)
+
+    def read_rx_errors(self):
+        """Returns the receive overruns and dropped bytes that the device has
+        counted."""
+        reply = self.query(CMD_READ_RX_ERRORS)
+        return int.from_bytes(reply[0:2], 'little'), int.from_bytes(reply[2:4], 'little')
+
+    def read_skipped(self):
+        """Returns the page erases that the device has skipped since reset
+        because the page was already blank, and the row writes skipped
+        because the row already held the instructions."""
+        reply = self.query(CMD_READ_SKIPPED)
+        return int.from_bytes(reply[0:2], 'little'), int.from_bytes(reply[2:4], 'little')
+
+    def read_stats(self):
+        """Returns the counters and timings of a BOOT_STATS build, with the
+        cycles converted to seconds."""
+        reply = self.query(CMD_READ_STATS)
+        (fcy, checksums, stale, overruns, dropped,
+         decode, tx_wait) = struct.unpack_from('<IHHHHII', reply)
+        stats = {'checksums': checksums, 'stale': stale, 'overruns': overruns,
+                 'dropped': dropped, 'decode': decode / fcy, 'tx_wait': tx_wait / fcy,
+                 'nvm': {}, 'commands': {}}
+        offset = struct.calcsize('<IHHHHII')
+        for name in STATS_NVM:
+            count, total, longest = struct.unpack_from('<HII', reply, offset)
+            stats['nvm'][name] = (count, total / fcy, longest / fcy)
+            offset += 10
+        while offset < len(reply):
+            cmd, count, total, longest = struct.unpack_from('<BHII', reply, offset)
+            stats['commands'][cmd] = (count, total / fcy, longest / fcy)
+            offset += 11
+        return stats
+
+    def read_trace(self):
+        """Empties the trace of a BOOT_TRACE build, returning the replies as
+        they came, which is the format that trace2chrome.py reads.  Reading
+        is recorded in the trace too, so it stops at the first reply that
+        isn't full."""
+        dump = bytearray()
+        while True:
+            reply = self.query(CMD_READ_TRACE, retries=0)
+            dump += reply
+            if int.from_bytes(reply[6:8], 'little') < TRACE_DUMP_LEN:
+                return bytes(dump)
+
+    def erase_page(self, address):
+        return self.send(CMD_ERASE_PAGE, u32(address))
+
+    def erase_range(self, start, end, page_time):
+        """Erases the pages from start up to end, apart from the
+        bootloader's, waiting up to twice page_time for each.  Returns the
+        number of pages that the device erased and the number that it found
+        blank and skipped."""
+        pages = (end - start + 2 * self.page_len - 1) // (2 * self.page_len)
+        reply = self.query(CMD_ERASE_RANGE, u32(start) + u32(end),
+                           timeout=self.timeout + 2 * pages * page_time)
+        return int.from_bytes(reply[0:2], 'little'), int.from_bytes(reply[2:4], 'little')
+
+    def write_row(self, address, words):
+        return self.send(CMD_WRITE_ROW, u32(address) + words_to_bytes(words))
+
+    def write_max(self, address, words):
+        return self.send(CMD_WRITE_MAX_PROG_SIZE, u32(address) + words_to_bytes(words))
+
+    def write_seq(self, seq, address, words, write_max=False, packed=False):
+        header = u16(seq & 0xffff) + u32(address)
+        if packed:
+            cmd = CMD_WRITE_MAX_PACKED if write_max else CMD_WRITE_ROW_PACKED
+            return self.send(cmd, header + pack_words(words))
+        cmd = CMD_WRITE_MAX_SEQ if write_max else CMD_WRITE_ROW_SEQ
+        return self.send(cmd, header + words_to_bytes(words))
+
+    def write_session(self, seq, words):
+        """Sends the next MAX_PROG_SIZE instructions of the open session."""
+        return self.send(CMD_WRITE_SESSION, u16(seq & 0xffff) + pack_words(words))
+
+    def write_reply(self, timeout=None):
+        """Waits for the reply to a sequenced write, returning (status, next
+        sequence number).  A frame that was corrupted on the way is reported
+        without a sequence number."""
+        while True:
+            cmd, reply = self.receive(timeout)
+            if cmd in (CMD_WRITE_SEQ_RESET, CMD_WRITE_ROW_SEQ, CMD_WRITE_MAX_SEQ,
+                       CMD_WRITE_ROW_PACKED, CMD_WRITE_MAX_PACKED, CMD_WRITE_SESSION):
+                return reply[0], reply[1] | (reply[2] << 8)
+            if cmd == CMD_STATUS:
+                if reply[0] in (STATUS_CHECKSUM, STATUS_LENGTH):
+                    self.statuses += 1
+                return reply[0], None
+
+    def read_max(self, address, packed=False):
+        if packed:
+            reply = self.query(CMD_READ_MAX_PACKED, u32(address))[4:]
+            return [int.from_bytes(reply[i:i + 3], 'little') for i in range(0, len(reply), 3)]
+        reply = self.query(CMD_READ_MAX, u32(address))
+        return bytes_to_words(reply)[1:]
+
+    def read_range(self, address, count, retries=2):
+        """Reads count instructions from the address with CMD_READ_RANGE,
+        which streams them back to back.  A frame that is lost or corrupted
+        is asked for again, along with everything after it."""
+        words = []
+        requested = None
+        while len(words) < count:
+            expected = address + 2 * len(words)
+            if requested is None:
+                self.send(CMD_READ_RANGE, u32(expected) + u32(count - len(words)))
+                requested = expected
+            try:
+                cmd, reply = self.receive()
+            except ProtocolError:
+                if not retries:
+                    raise
+                retries -= 1
+                requested = None
+                continue
+            if cmd == CMD_STATUS and reply[1] == CMD_READ_RANGE:
+                raise ProtocolError('command 0x{:02x} refused with status {}'.format(
+                    CMD_READ_RANGE, reply[0]))
+            if cmd != CMD_READ_RANGE:
+                continue
+            at = int.from_bytes(reply[0:4], 'little')
+            if at == expected:
+                words += [int.from_bytes(reply[i:i + 3], 'little') for i in range(4, len(reply), 3)]
+            elif at > expected and requested != expected:
+                # a frame went missing, so ask again from there; the rest of
+                # this stream arrives first and is passed over
+                if not retries:
+                    raise ProtocolError('lost the frame at 0x{:x}'.format(expected))
+                retries -= 1
+                requested = None
+        return words
+
+    def read_crc(self, address, count):
+        """The CRC-32 of count instructions from the address, as
+        zlib.crc32() would give for them packed 3 bytes each."""
+        reply = self.query(CMD_READ_CRC, u32(address) + u32(count))
+        return bytes_to_words(reply)[2]
+
+    def sync(self, duration):
+        """Keeps asking for the descriptor for up to duration seconds, to
+        catch a device in the FAST_BOOT_TIME after its reset.  Returns True
+        once it answers."""
+        deadline = time.monotonic() + duration
+        while time.monotonic() < deadline:
+            self.send(CMD_READ_DESCRIPTOR)
+            try:
+                self.receive(timeout=0.01)
+            except ProtocolError:
+                continue
+            # let the replies to the other frames that were sent arrive
+            while True:
+                try:
+                    self.receive(timeout=0.05)
+                except ProtocolError:
+                    break
+            self.pending.clear()
+            return True
+        return False
+
+    def write_app_record(self, count, crc):
+        """Records that count instructions from the application start
+        address have the CRC-32, which the device checks before writing."""
+        reply = self.query(CMD_WRITE_APP_RECORD, u32(count) + u32(crc), retries=0)
+        return bytes_to_words(reply)
+
+    def set_baud(self, baud):
+        """Moves the device and the port to the baud rate (or as near as the
+        device can get), returning the rate in use afterwards.  The device
+        goes back to the old rate by itself unless an intact frame arrives at
+        the new one, so a rate that doesn't work costs BAUD_CONFIRM_WAIT."""
+        try:
+            actual = bytes_to_words(self.query(CMD_SET_BAUD, u32(baud)))[0]
+        except ProtocolError:
+            return self.baud
+        previous = self.baud
+        self.port.set_baud(actual)
+        self.baud = actual
+        try:
+            self.query(CMD_READ_VERSION)
+        except ProtocolError:
+            time.sleep(BAUD_CONFIRM_WAIT)
+            self.port.set_baud(previous)
+            self.baud = previous
+            self.pending.clear()
+        return self.baud
+
+    def set_framing(self, framing):
+        """Moves the device and the loader to the framing, returning the
+        framing in use afterwards.  As with set_baud(), the device goes back
+        to the old framing unless an intact frame arrives in the new one."""
+        try:
+            self.query(CMD_SET_FRAMING, bytes((framing,)))
+        except ProtocolError:
+            return self.framing
+        previous = self.framing
+        self.framing = framing
+        try:
+            self.query(CMD_READ_VERSION)
+        except ProtocolError:
+            time.sleep(BAUD_CONFIRM_WAIT)
+            self.framing = previous
+            self.pending.clear()
+        return self.framing
+
+    def start_app(self):
+        self.send(CMD_START_APP)
+
+
+def chunks(image, size):
+    """Groups the image into {chunk address: [words]} of `size` instructions,
+    padding with erased words."""
+    span = size * 2
+    result = {}
+    for address in sorted(image):
+        base = address - (address % span)
+        words = result.setdefault(base, [0xffffff] * size)
+        words[(address - base) >> 1] = image[address]
+    return result
+
+
+def protected(dev, address):
+    return dev.boot_start <= address < dev.app_start
+
+
+def page_runs(dev, pages):
+    """Groups sorted page addresses into (first, last) runs, joining those
+    that only the bootloader's pages lie between."""
+    span = dev.page_len * 2
+    groups = []
+    for address in pages:
+        if groups and all(protected(dev, between)
+                          for between in range(groups[-1][1] + span, address, span)):
+            groups[-1][1] = address
+        else:
+            groups.append([address, address])
+    return [tuple(group) for group in groups]
+
+
+def runs(words):
+    """Splits {address: word} into runs of consecutive instructions,
+    returning [(start address, [words])]."""
+    result = []
+    for address in sorted(words):
+        if result and address == result[-1][0] + 2 * len(result[-1][1]):
+            result[-1][1].append(words[address])
+        else:
+            result.append((address, [words[address]]))
+    return result
+
+
+def unchanged_pages(dev, image, pages):
+    """The pages whose contents on the device already match the image,
+    found by comparing the CRC of each against the image.  The first page
+    is always rewritten, since the device keeps its own reset vector there."""
+    page_span = dev.page_len * 2
+    result = set()
+    for address in pages:
+        if address == 0:
+            continue
+        words = [image.get(address + 2 * i, 0xffffff) for i in range(dev.page_len)]
+        if dev.read_crc(address, dev.page_len) == zlib.crc32(pack_words(words)):
+            result.add(address)
+    return result
+
+
+def count_mismatches(dev, expected, packed=False):
+    """Reads back the {address: word} and counts the instructions that
+    differ, streaming each run of them when the device has CMD_READ_RANGE."""
+    mismatches = 0
+    if dev.capabilities & CAP_READ_RANGE:
+        for address, words in runs(expected):
+            readback = dev.read_range(address, len(words))
+            mismatches += sum(1 for got, word in zip(readback, words)
+                              if got != word & 0xffffff)
+        return mismatches
+    for address, words in sorted(chunks(expected, dev.max_prog_size).items()):
+        readback = dev.read_max(address, packed=packed)
+        for i, word in enumerate(words):
+            location = address + 2 * i
+            if location not in expected:
+                continue
+            if readback[i] & 0xffffff != word & 0xffffff:
+                mismatches += 1
+    return mismatches
+
+
+def write_sequenced(dev, writes, window, write_max=False, packed=False):
+    """Programs the frames with the sequenced write commands, keeping up to
+    window frames in flight and going back to the first unacknowledged frame
+    on a NAK or a timeout.  Returns the number of frames sent again."""
+    frames = sorted(writes.items())
+    dev.query(CMD_WRITE_SEQ_RESET)
+
+    base = sent = resent = 0
+    rewound = None
+    while base < len(frames):
+        while sent < len(frames) and sent - base < window:
+            dev.write_seq(sent, *frames[sent], write_max=write_max, packed=packed)
+            sent += 1
+        try:
+            status, expected = dev.write_reply()
+        except ProtocolError:
+            resent += sent - base
+            sent = base
+            continue
+        if expected is not None:
+            # the device reports the next sequence number modulo 16 bits
+            acked = base + ((expected - base) & 0xffff)
+            if acked > base:
+                base = acked
+                rewound = None
+        if status in (STATUS_OUT_OF_ORDER, STATUS_CHECKSUM, STATUS_LENGTH) and rewound != base:
+            # every frame behind a lost one is refused, so only go back once
+            resent += sent - base
+            sent = rewound = base
+    return resent
+
+
+def write_sessions(dev, writes, window):
+    """Programs the frames in write sessions, one for each run of frames that
+    follow on from each other, keeping up to window frames in flight.  The
+    device ends a session at a gap in the sequence, so after a NAK or a
+    timeout the session is opened again at the first unacknowledged frame.
+    Returns the number of frames sent again."""
+    span = 2 * dev.max_prog_size
+    frames = sorted(writes.items())
+    resent = first = 0
+    while first < len(frames):
+        last = first + 1
+        while last < len(frames) and frames[last][0] == frames[last - 1][0] + span:
+            last += 1
+        run = [words for _, words in frames[first:last]]
+
+        # origin is the frame that the session was opened at, which the
+        # sequence numbers count from
+        base = sent = 0
+        origin = None
+        while base < len(run):
+            if origin is None:
+                try:
+                    dev.query(CMD_WRITE_SESSION_OPEN, u32(frames[first + base][0]))
+                except ProtocolError:
+                    # lost like any frame on a bad line, so keep at it
+                    continue
+                origin = sent = base
+            while sent < len(run) and sent - base < window:
+                dev.write_session(sent - origin, run[sent])
+                sent += 1
+            try:
+                status, expected = dev.write_reply()
+            except ProtocolError:
+                resent += sent - base
+                origin = None
+                continue
+            if expected is not None:
+                acked = base + ((expected - (base - origin)) & 0xffff)
+                if acked > base:
+                    base = acked
+            if status in (STATUS_OUT_OF_ORDER, STATUS_CHECKSUM, STATUS_LENGTH):
+                # the replies to the frames behind it are passed over while
+                # the session is opened again
+                resent += sent - base
+                origin = None
+        dev.query(CMD_WRITE_SESSION_CLOSE)
+        first = last
+    return resent
+
+
+def app_extent(dev, writes):
+    """The application as the device will hold it: from the application
+    start address to the end of the last frame, with erased instructions in
+    the gaps."""
+    end = min(max(writes) + 2 * len(writes[max(writes)]), dev.prog_len)
+    words = [0xffffff] * ((end - dev.app_start) // 2)
+    for address, frame in writes.items():
+        for i, word in enumerate(frame):
+            location = address + 2 * i
+            if dev.app_start <= location < end:
+                words[(location - dev.app_start) // 2] = word
+    return words
+
+
+def backup(dev):
+    """Reads the whole of program memory, returning the instructions that
+    aren't erased as {address: word}.  It is streamed with CMD_READ_RANGE
+    when the device has it, or read a frame at a time otherwise."""
+    count = dev.prog_len // 2
+    if dev.capabilities & CAP_READ_RANGE:
+        words = dev.read_range(0, count)
+    else:
+        words = []
+        for address in range(0, dev.prog_len, 2 * dev.max_prog_size):
+            words += dev.read_max(address, packed=bool(dev.capabilities & CAP_PACKED))
+    return {2 * i: word for i, word in enumerate(words[:count]) if word != 0xffffff}
+
+
+def load(dev, image, erase_delay, write_delay, write_max=False, verify=True,
+         window=0, packed=False, crc=False, delta=False,
+         record=False, session=False, log=print):
+    """Erases, programs and verifies the image, returning the time taken to
+    program, the total time and the number of mismatched instructions.  With
+    a window, the frames are sent with the sequenced write commands instead of
+    waiting a fixed time for each.  packed sends and reads back 3 bytes per
+    instruction, and is always sequenced.  crc verifies each run of instructions with CMD_READ_CRC and
+    only reads back the runs that differ, and delta leaves alone the pages
+    whose CRC already matches the image.  record erases every page of the
+    application and, once it has verified, writes the application record so
+    that the device starts it without waiting.  session programs each run
+    of frames in a write session, whose frames carry no address."""
+    if packed or session:
+        window = window or 1
+    if session:
+        write_max = True
+    if session:
+        packed = True
+    page_span = dev.page_len * 2
+    size = dev.max_prog_size if write_max else dev.row_len
+    write = dev.write_max if write_max else dev.write_row
+    writes = {address: words for address, words in chunks(image, size).items()
+              if not protected(dev, address) and address < dev.prog_len}
+    pages = {address - (address % page_span) for address in writes}
+    if record:
+        # the record only holds for the application if nothing is left over
+        # from before, and it lives in the first page
+        extent = app_extent(dev, writes)
+        pages |= set(range(dev.app_start - dev.app_start % page_span,
+                           dev.app_start + 2 * len(extent), page_span)) | {0}
+    pages = sorted(pages - {address for address in range(0, dev.prog_len, page_span)
+                            if protected(dev, address)})
+
+    start = time.monotonic()
+    if delta:
+        skipped = unchanged_pages(dev, image, pages)
+        pages = [address for address in pages if address not in skipped]
+        writes = {address: words for address, words in writes.items()
+                  if address - (address % page_span) not in skipped}
+        log('{} pages unchanged in {:.3f}s'.format(len(skipped), time.monotonic() - start))
+
+    if dev.capabilities & CAP_ERASE_RANGE:
+        # one frame for each run of pages, which the device leaves the
+        # bootloader out of
+        for first, last in page_runs(dev, pages):
+            run = [address for address in range(first, last + page_span, page_span)
+                   if not protected(dev, address)]
+            done = sum(dev.erase_range(first, last + page_span, erase_delay))
+            # a range stops short of the page with the configuration words,
+            # which is only erased on its own
+            for address in run[done:]:
+                time.sleep(dev.erase_page(address) + erase_delay)
+    else:
+        # neither command replies, so wait for the frame to cross the wire
+        # and the operation to finish before sending the next one
+        for address in pages:
+            time.sleep(dev.erase_page(address) + erase_delay)
+    erased = time.monotonic()
+    resent = 0
+    if session:
+        resent = write_sessions(dev, writes, window)
+    elif window:
+        resent = write_sequenced(dev, writes, window, write_max, packed)
+    else:
+        for address, words in sorted(writes.items()):
+            time.sleep(write(address, words) + write_delay)
+    programmed = time.monotonic()
+    log('erased {} pages in {:.3f}s, wrote {} frames in {:.3f}s{}'.format(
+        len(pages), erased - start, len(writes), programmed - erased,
+        ', {} sent again'.format(resent) if window else ''))
+
+    mismatches = 0
+    if verify:
+        expected = {}
+        kept = {U1RX_AIVT_ADDRESS} if dev.capabilities & CAP_RX_INTERRUPT else set()
+        for address, words in writes.items():
+            for i, word in enumerate(words):
+                # the device rewrites the reset vector itself, and keeps
+                # its own U1RX vector
+                if address + 2 * i >= 4 and address + 2 * i not in kept:
+                    expected[address + 2 * i] = word
+        if crc:
+            for address, words in runs(expected):
+                if dev.read_crc(address, len(words)) != zlib.crc32(pack_words(words)):
+                    run = {address + 2 * i: word for i, word in enumerate(words)}
+                    mismatches += count_mismatches(dev, run, packed)
+        else:
+            mismatches = count_mismatches(dev, expected, packed)
+        log('verified in {:.3f}s, {} mismatched instructions'.format(
+            time.monotonic() - programmed, mismatches))
+
+    if record and not mismatches:
+        try:
+            dev.write_app_record(len(extent), zlib.crc32(pack_words(extent)))
+            log('recorded {} instructions'.format(len(extent)))
+        except ProtocolError as error:
+            log('application record refused: {}'.format(error))
+
+    return programmed - start, time.monotonic() - start, mismatches
+
+
+class Simulator:
+    """Runs a simulator build and connects to its pseudo-terminal."""
+
+    def __init__(self, path, fast=False, flash=None, errors=0, wake=bytes((END_OF_FRAME,)),
+                 mailbox=False):
+        args = ([path] + (['-r'] if wake is not None else []) + (['-x'] if fast else [])
+                + (['-f', flash] if flash else []) + (['-e', str(errors)] if errors else [])
+                + (['-m'] if mailbox else []))
+        self.process = subprocess.Popen(args, stdout=subprocess.PIPE,
+                                        stderr=subprocess.PIPE, text=True)
+        self.pty = self.process.stdout.readline().strip()
+
+        # the device is held in reset until the host sends something, so that
+        # a recorded application doesn't start before the loader is there; a
+        # lone end of frame is ignored by the bootloader, and anything else in
+        # wake arrives while it starts up, with the replies kept on self.port.
+        # With no wake at all, the device starts as it would with no host, and
+        # with mailbox as it would when the application asked for an update
+        self.port = Port(self.pty)
+        if wake is not None:
+            self.port.write(wake)
+        banner = dict(re.findall(r'(\w+)=(\S+)', self.process.stderr.readline()))
+        self.baud = int(banner.get('baud', 115200))
+
+    def finish(self, timeout=30):
+        """Waits for the simulator to exit and returns its summary as a dict."""
+        _, err = self.process.communicate(timeout=timeout)
+        self.port.close()
+        summary = {}
+        for line in err.splitlines():
+            if line.startswith('bootypic-sim:'):
+                summary.update(dict(re.findall(r'(\w+)=(\S+)', line)))
+                summary['line'] = line
+        return summary
+
+
+def print_stats(stats):
+    print('device stats: {checksums} checksum failures, {stale} stale frames, {overruns} overruns, '
+          '{dropped} bytes dropped'.format(**stats))
+    print('  decoding {:.3f}s, waiting to transmit {:.3f}s'.format(stats['decode'], stats['tx_wait']))
+    print('  {:<12} {:>6} {:>10} {:>10} {:>10}'.format('', 'count', 'total', 'mean', 'longest'))
+    rows = [(name, value) for name, value in stats['nvm'].items()]
+    rows += [('cmd 0x{:02x}'.format(cmd), value) for cmd, value in stats['commands'].items()]
+    for name, (count, total, longest) in rows:
+        if count:
+            print('  {:<12} {:>6} {:>9.3f}s {:>8.3f}ms {:>8.3f}ms'.format(
+                name, count, total, 1000 * total / count, 1000 * longest))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('hexfile', nargs='?', help='XC16 hex file to load')
+    parser.add_argument('--port', help='serial port or pseudo-terminal')
+    parser.add_argument('--baud', type=int, default=115200,
+                        help='baud rate of the port (taken from the simulator with --sim)')
+    parser.add_argument('--sim', help='simulator executable to run and connect to')
+    parser.add_argument('--set-baud', type=int, metavar='BAUD',
+                        help='switch to this baud rate with CMD_SET_BAUD once connected')
+    parser.add_argument('--cobs', action='store_true',
+                        help='switch to COBS framing with CMD_SET_FRAMING once connected')
+    parser.add_argument('--synthetic', type=int, metavar='BYTES',
+                        help='load a generated image of this many bytes instead of a hex file')
+    parser.add_argument('--erase-delay', type=float, default=0.025)
+    parser.add_argument('--write-delay', type=float, default=0.005)
+    parser.add_argument('--write-max', action='store_true',
+                        help='program with CMD_WRITE_MAX_PROG_SIZE instead of CMD_WRITE_ROW')
+    parser.add_argument('--window', type=int, default=0,
+                        help='use the sequenced write commands with this many frames in flight')
+    parser.add_argument('--packed', action='store_true',
+                        help='program and verify with 3 bytes per instruction')
+    parser.add_argument('--session', action='store_true',
+                        help='program with write sessions, whose frames carry no address')
+    parser.add_argument('--no-verify', action='store_true')
+    parser.add_argument('--crc', action='store_true',
+                        help='verify with CMD_READ_CRC, reading back only the ranges that differ')
+    parser.add_argument('--delta', action='store_true',
+                        help='skip the pages whose CRC already matches the image')
+    parser.add_argument('--record', action='store_true',
+                        help='erase the whole application and record it once verified, '
+                             'so that the device starts it straight after a reset')
+    parser.add_argument('--backup', metavar='FILE',
+                        help='save the flash of the device as a hex file first, leaving out '
+                             'erased instructions')
+    parser.add_argument('--sync', type=float, default=0, metavar='SECONDS',
+                        help='keep calling the device for this long first, to catch it in '
+                             'the moments after a reset')
+    parser.add_argument('--sim-flash', metavar='FILE',
+                        help='flash image that the simulator loads at reset and saves on exit')
+    parser.add_argument('--fast', action='store_true',
+                        help='run the simulator without pacing it to the wall clock (needs --window, '
+                             '--packed or --session, since the fixed delays between '
+                             'unacknowledged frames are not simulated)')
+    parser.add_argument('--stats', action='store_true',
+                        help='print the timings of a device built with BOOT_STATS afterwards')
+    parser.add_argument('--trace', metavar='FILE',
+                        help='save the trace of a device built with BOOT_TRACE afterwards, '
+                             'for trace2chrome.py')
+    parser.add_argument('--line-errors', type=int, default=0, metavar='PPM',
+                        help='have the simulator corrupt this many of every million bytes it receives')
+    args = parser.parse_args()
+    if args.fast and not (args.window or args.packed or args.session):
+        parser.error('--fast needs --window, --packed or --session')
+
+    sim = (Simulator(args.sim, fast=args.fast, flash=args.sim_flash, errors=args.line_errors)
+           if args.sim else None)
+    path = sim.pty if sim else args.port
+    if path is None:
+        parser.error('one of --port or --sim is required')
+
+    dev = Device(Port(path), sim.baud if sim else args.baud)
+    if args.sync and not dev.sync(args.sync):
+        parser.error('no reply from the device in {}s'.format(args.sync))
+    dev.identify()
+    print('{} (protocol {}), row {}, page {}, transfer {}, app 0x{:x}, capabilities 0x{:x}'.format(
+        dev.platform, dev.version, dev.row_len, dev.page_len,
+        dev.max_prog_size, dev.app_start, dev.capabilities))
+    if args.set_baud:
+        if not dev.capabilities & CAP_SET_BAUD:
+            parser.error('the device has no CMD_SET_BAUD')
+        print('running at {} baud'.format(dev.set_baud(args.set_baud)))
+    if args.cobs:
+        if not dev.capabilities & CAP_COBS:
+            parser.error('the device has no COBS framing')
+        if dev.set_framing(FRAMING_COBS) != FRAMING_COBS:
+            print('COBS framing was not confirmed, staying with escaping')
+
+    if args.session and not dev.capabilities & CAP_SESSION:
+        parser.error('the device has no write sessions')
+    if args.window and not dev.capabilities & CAP_SEQUENCED:
+        parser.error('the device has no sequenced writes')
+    if args.packed and not dev.capabilities & CAP_PACKED:
+        parser.error('the device has no packed instructions')
+    if (args.crc or args.delta) and not dev.capabilities & CAP_CRC:
+        parser.error('the device has no CMD_READ_CRC')
+    if args.record and not dev.capabilities & CAP_APP_RECORD:
+        parser.error('the device has no application record')
+
+    if args.backup:
+        start = time.monotonic()
+        image = backup(dev)
+        write_hex(args.backup, image)
+        print('backed up {} kB of flash in {:.3f}s'.format(
+            dev.prog_len * 3 // 2048, time.monotonic() - start))
+
+    if args.synthetic:
+        image = synthetic_image(args.synthetic, dev.app_start)
+    elif args.hexfile:
+        image = read_hex(args.hexfile)
+    elif not args.backup:
+        parser.error('a hex file, --synthetic or --backup is required')
+
+    mismatches = 0
+    if args.synthetic or args.hexfile:
+        _, total, mismatches = load(dev, image, args.erase_delay, args.write_delay,
+                                    write_max=args.write_max, verify=not args.no_verify,
+                                    window=args.window, packed=args.packed,
+                                    crc=args.crc, delta=args.delta,
+                                    record=args.record, session=args.session)
+        print('total {:.3f}s, {} bytes sent, {} bytes received'.format(
+            total, dev.wire_tx, dev.wire_rx))
+    print('device receive: {} overruns, {} bytes dropped, {} frames reported corrupt'.format(
+        *dev.read_rx_errors(), dev.statuses))
+    if dev.capabilities & CAP_READ_SKIPPED:
+        print('device skipped {} erases of blank pages and {} writes of matching rows'.format(
+            *dev.read_skipped()))
+    if args.stats:
+        print_stats(dev.read_stats())
+    if args.trace:
+        with open(args.trace, 'wb') as trace:
+            trace.write(dev.read_trace())
+
+    dev.start_app()
+    if sim:
+        print(sim.finish()['line'])
+    return 1 if mismatches else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
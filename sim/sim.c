@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xc.h"
+#include "bootloader.h"
+#include "sim.h"
+
+/* bytes the host has written that are still in flight on the wire */
+#define WIRE_LEN        0x10000
+
+/* the receive FIFO is 4 deep, the transmit side holds 4 bytes plus the
+ * byte in the shift register */
+#define RX_FIFO_LEN     4
+#define TX_FIFO_LEN     5
+
+/* marks U1TXREG as not written since the last access */
+#define TX_REG_EMPTY    0xffff
+
+/* how often the virtual clock is checked against the wall clock */
+#define PACE_INTERVAL_US 100
+
+/* in fast mode, the calls to ClrWdt() in a row that find nothing to do 
+ * before the device is taken to be waiting on the host; a command that
+ * clears the watchdog on its way through pages it skips, such as
+ * CMD_ERASE_RANGE over the bootloader, makes fewer than this */
+#define IDLE_CALLS      64
+
+uint64_t simCycles = 0;
+
+/* the RAM that the linker scripts keep for the boot mailbox on the device */
+volatile uint16_t bootMailbox[2];
+
+U1MODEBITS U1MODEbits;
+volatile uint16_t U1BRG = 0;
+
+static U1STABITS u1sta;
+static volatile uint16_t u1txreg = TX_REG_EMPTY;
+
+static uint8_t wireData[WIRE_LEN];
+static uint64_t wireTime[WIRE_LEN];
+static uint32_t wireHead = 0, wireTail = 0;
+static uint64_t wireLastArrival = 0;
+
+static uint8_t rxFifo[RX_FIFO_LEN];
+static uint16_t rxFifoHead = 0, rxFifoCount = 0;
+
+static uint8_t txData[TX_FIFO_LEN];
+static uint64_t txDone[TX_FIFO_LEN];
+static uint16_t txHead = 0, txCount = 0;
+static uint64_t txLastDone = 0;
+
+typedef struct {
+    TxCONBITS con;
+    volatile uint16_t value;
+    uint64_t last;
+} SimTimer;
+
+static SimTimer timers[3];
+
+static uint32_t* flash = NULL;
+static uint32_t flashWords = __PROGRAM_LENGTH >> 1;
+
+static struct {
+    bool started;
+    uint64_t firstRx;
+    uint32_t rxBytes, txBytes;
+    uint32_t overruns, dropped, corrupted;
+    uint32_t erases, programs, words;
+    uint64_t nvmCycles;
+} stats;
+
+static bool fastMode = false;
+static uint32_t lineErrorPpm = 0;
+static const char* flashFile = NULL;
+static const char* linkPath = NULL;
+static int ptyFd = -1, slaveFd = -1;
+static struct timespec wallStart;
+static uint64_t nextPace = 0;
+static volatile sig_atomic_t stopRequested = 0;
+static bool exiting = false;
+static bool flashRead = false;
+static uint16_t idleCalls = 0;
+
+/* the flash controller stalls the CPU for each operation, so NVMCON.WR
+ * has always cleared by the time it is read */
+static NVMCONBITS nvmcon;
+
+/* the U1RX interrupt, which is only taken through the alternate vector
+ * table since the bootloader has no other */
+static IFS0BITS ifs0;
+static IEC0BITS iec0;
+static INTCON2BITS intcon2;
+#if defined(BOOT_RX_INTERRUPT)
+static bool inInterrupt = false;
+#endif
+
+static void update(void);
+
+uint64_t simMicroseconds(uint32_t us){
+    return ((uint64_t)us * FCY) / 1000000ULL;
+}
+
+static uint64_t byteCycles(void){
+    /* start bit, 8 data bits, stop bit */
+    uint64_t divisor = U1MODEbits.BRGH ? 4 : 16;
+    return 10ULL * divisor * ((uint64_t)U1BRG + 1);
+}
+
+static uint64_t wallCycles(void){
+    struct timespec now;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (uint64_t)(now.tv_sec - wallStart.tv_sec) * 1000000000ULL
+            + (uint64_t)now.tv_nsec - (uint64_t)wallStart.tv_nsec;
+
+    return (ns * (FCY / 1000000ULL)) / 1000ULL;
+}
+
+/* moves whatever the host has written onto the wire, each byte arriving one
+ * character time after the previous one */
+static void readHost(const struct timespec* timeout){
+    struct pollfd pfd = {ptyFd, POLLIN, 0};
+    uint8_t buffer[1024];
+    uint32_t space = WIRE_LEN - (wireHead - wireTail);
+    ssize_t n, i;
+
+    if(space == 0)
+        return;
+
+    if(ppoll(&pfd, 1, timeout, NULL) <= 0)
+        return;
+
+    if(!(pfd.revents & POLLIN))
+        return;
+
+    n = read(ptyFd, buffer, (space < sizeof(buffer)) ? space : sizeof(buffer));
+    for(i=0; i<n; i++){
+        uint64_t start = (wireLastArrival > simCycles) ? wireLastArrival : simCycles;
+
+        /* flip a bit in some of the bytes, as a noisy line would */
+        if(lineErrorPpm && (((uint32_t)rand() % 1000000) < lineErrorPpm)){
+            buffer[i] ^= (uint8_t)(1 << (rand() % 8));
+            stats.corrupted++;
+        }
+
+        wireLastArrival = start + byteCycles();
+        wireData[wireHead & (WIRE_LEN - 1)] = buffer[i];
+        wireTime[wireHead & (WIRE_LEN - 1)] = wireLastArrival;
+        wireHead++;
+    }
+}
+
+/* keeps the virtual clock from running ahead of the wall clock so that the
+ * host sees the same timing as it would from the device */
+static void pace(void){
+    static const struct timespec noWait = {0, 0};
+    uint64_t wall;
+
+    if(simCycles < nextPace)
+        return;
+    nextPace = simCycles + simMicroseconds(PACE_INTERVAL_US);
+
+    if(fastMode){
+        readHost(&noWait);
+        return;
+    }
+
+    wall = wallCycles();
+    if(simCycles > wall){
+        uint64_t ns = ((simCycles - wall) * 1000ULL) / (FCY / 1000000ULL);
+        struct timespec timeout = {(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL)};
+
+        readHost(&timeout);
+    }else{
+        readHost(&noWait);
+    }
+}
+
+static void commitTx(void){
+    uint64_t start;
+    uint16_t index;
+
+    if(u1txreg == TX_REG_EMPTY)
+        return;
+
+    /* writes to a full buffer are lost, as on the device */
+    if(U1MODEbits.UARTEN && u1sta.UTXEN && (txCount < TX_FIFO_LEN)){
+        start = (txLastDone > simCycles) ? txLastDone : simCycles;
+        txLastDone = start + byteCycles();
+
+        index = (txHead + txCount) % TX_FIFO_LEN;
+        txData[index] = (uint8_t)u1txreg;
+        txDone[index] = txLastDone;
+        txCount++;
+    }
+
+    u1txreg = TX_REG_EMPTY;
+}
+
+static void update(void){
+    uint8_t out[TX_FIFO_LEN];
+    uint16_t outCount = 0;
+
+    if(stopRequested && !exiting)
+        simExit(0);
+
+    commitTx();
+    pace();
+
+    /* receive */
+    while((wireHead != wireTail) && (wireTime[wireTail & (WIRE_LEN - 1)] <= simCycles)){
+        uint8_t byte = wireData[wireTail & (WIRE_LEN - 1)];
+
+        if(!stats.started){
+            stats.started = true;
+            stats.firstRx = wireTime[wireTail & (WIRE_LEN - 1)];
+        }
+        wireTail++;
+        stats.rxBytes++;
+
+        /* the receiver stops while OERR is set, so everything is lost
+         * until the software clears it */
+        if(u1sta.OERR){
+            stats.dropped++;
+        }else if(rxFifoCount == RX_FIFO_LEN){
+            u1sta.OERR = 1;
+            stats.overruns++;
+            stats.dropped++;
+        }else{
+            rxFifo[(rxFifoHead + rxFifoCount) % RX_FIFO_LEN] = byte;
+            rxFifoCount++;
+            ifs0.U1RXIF = 1;
+        }
+    }
+
+    /* transmit */
+    while(txCount && (txDone[txHead] <= simCycles)){
+        out[outCount++] = txData[txHead];
+        txHead = (txHead + 1) % TX_FIFO_LEN;
+        txCount--;
+    }
+    if(outCount){
+        stats.txBytes += outCount;
+        if(write(ptyFd, out, outCount) < 0)
+            perror("bootypic-sim: write");
+    }
+
+    u1sta.URXDA = (rxFifoCount > 0);
+    u1sta.UTXBF = (txCount >= TX_FIFO_LEN);
+    u1sta.TRMT = (txCount == 0);
+
+#if defined(BOOT_RX_INTERRUPT)
+    /* the interrupt is taken between two register accesses, which is as
+     * close as the model gets to between two instructions */
+    if(ifs0.U1RXIF && iec0.U1RXIE && intcon2.ALTIVT && !inInterrupt){
+        inInterrupt = true;
+        simCycles += SIM_ISR_CYCLES;
+        _AltU1RXInterrupt();
+        inInterrupt = false;
+    }
+#endif
+}
+
+void simAdvance(uint64_t cycles){
+    simCycles += cycles;
+    update();
+}
+
+void simUartInit(void){
+    u1sta.UTXEN = 1;
+    U1MODEbits.UARTEN = 1;
+    rxFifoCount = 0;
+    txCount = 0;
+
+    fprintf(stderr, "bootypic-sim: %s baud=%lu\n", PLATFORM_STRING,
+            (unsigned long)((10ULL * FCY) / byteCycles()));
+    update();
+}
+
+static void timerSync(SimTimer* timer){
+    static const uint16_t prescale[] = {1, 8, 64, 256};
+    uint64_t ticks;
+
+    if(timer->con.TON){
+        ticks = (simCycles - timer->last) / prescale[timer->con.TCKPS];
+        timer->value += (uint16_t)ticks;
+        timer->last += ticks * prescale[timer->con.TCKPS];
+    }else{
+        timer->last = simCycles;
+    }
+}
+
+void simTimersInit(uint16_t t1con, uint16_t t2con){
+    uint16_t cons[3] = {0, t1con, t2con};
+    uint16_t i;
+
+    for(i=1; i<3; i++){
+        memset(&timers[i], 0, sizeof(timers[i]));
+        timers[i].con.TCKPS = (cons[i] >> 4) & 0x3;
+        timers[i].con.TON = (cons[i] >> 15) & 0x1;
+        timers[i].last = simCycles;
+    }
+}
+
+U1STABITS* simU1sta(void){
+    simAdvance(SIM_ACCESS_CYCLES);
+    return &u1sta;
+}
+
+uint16_t simU1rxreg(void){
+    uint8_t byte = 0;
+
+    simAdvance(SIM_ACCESS_CYCLES);
+    if(rxFifoCount){
+        byte = rxFifo[rxFifoHead];
+        rxFifoHead = (rxFifoHead + 1) % RX_FIFO_LEN;
+        rxFifoCount--;
+    }
+    u1sta.URXDA = (rxFifoCount > 0);
+
+    return byte;
+}
+
+volatile uint16_t* simU1txreg(void){
+    simAdvance(SIM_ACCESS_CYCLES);
+    return &u1txreg;
+}
+
+volatile uint16_t* simTmr(uint16_t timer){
+    simAdvance(SIM_ACCESS_CYCLES);
+    timerSync(&timers[timer]);
+    return &timers[timer].value;
+}
+
+TxCONBITS* simTxcon(uint16_t timer){
+    simAdvance(SIM_ACCESS_CYCLES);
+    timerSync(&timers[timer]);
+    return &timers[timer].con;
+}
+
+NVMCONBITS* simNvmcon(void){
+    simAdvance(SIM_ACCESS_CYCLES);
+    return &nvmcon;
+}
+
+IFS0BITS* simIfs0(void){
+    simAdvance(SIM_ACCESS_CYCLES);
+    return &ifs0;
+}
+
+IEC0BITS* simIec0(void){
+    simAdvance(SIM_ACCESS_CYCLES);
+    return &iec0;
+}
+
+INTCON2BITS* simIntcon2(void){
+    simAdvance(SIM_ACCESS_CYCLES);
+    return &intcon2;
+}
+
+/* accounts for a flash operation, stalling the CPU for it */
+static void nvmCycle(uint32_t us){
+    uint64_t cycles = simMicroseconds(us);
+
+    stats.nvmCycles += cycles;
+    simAdvance(cycles);
+}
+
+void simClrWdt(void){
+    simAdvance(SIM_LOOP_CYCLES);
+
+    /* in fast mode, time spent waiting on the host is not simulated; a flash
+     * read since the last call means that this is a command working through
+     * a range rather than the main loop, so it is not waiting on anything,
+     * and neither is the decoder while bytes wait in the ring, nor the 
+     * transmitter while a reply does */
+    if(fastMode && !flashRead && (wireHead == wireTail) && !rxFifoCount && !txCount
+            && !rxPending() && !txPending()){
+        if(++idleCalls >= IDLE_CALLS){
+            idleCalls = 0;
+            readHost(NULL);
+        }
+    }else{
+        idleCalls = 0;
+    }
+    flashRead = false;
+}
+
+uint32_t simFlashRead(uint32_t address){
+    uint32_t index = address >> 1;
+
+    simAdvance(SIM_ACCESS_CYCLES);
+    flashRead = true;
+    if(index >= flashWords)
+        return 0;
+
+    return flash[index];
+}
+
+void simFlashErase(uint32_t address, uint32_t us){
+    uint32_t index = (address >> 1) & ~((uint32_t)_FLASH_PAGE - 1);
+    uint32_t i;
+
+    if(index >= flashWords){
+        fprintf(stderr, "bootypic-sim: erase of unimplemented address 0x%06x\n", address);
+    }else{
+        for(i=0; (i < _FLASH_PAGE) && (index + i < flashWords); i++)
+            flash[index + i] = 0xffffff;
+    }
+
+    stats.erases++;
+    nvmCycle(us);
+}
+
+void simFlashProgram(uint32_t address, uint32_t* words, uint16_t count, uint32_t us){
+    uint32_t index = address >> 1;
+    uint16_t i;
+
+    for(i=0; i<count; i++){
+        if(index + i >= flashWords){
+            fprintf(stderr, "bootypic-sim: write to unimplemented address 0x%06x\n",
+                    (index + i) << 1);
+            break;
+        }
+        flash[index + i] &= (words[i] & 0xffffff);
+    }
+
+    stats.programs++;
+    stats.words += count;
+    nvmCycle(us);
+}
+
+static void loadFlash(void){
+    FILE* file;
+    uint8_t bytes[4];
+    uint32_t i;
+
+    for(i=0; i<flashWords; i++)
+        flash[i] = 0xffffff;
+
+    if(flashFile == NULL)
+        return;
+
+    file = fopen(flashFile, "rb");
+    if(file == NULL)
+        return;
+
+    for(i=0; (i < flashWords) && (fread(bytes, 1, 4, file) == 4); i++){
+        flash[i] = (uint32_t)bytes[0]
+                + ((uint32_t)bytes[1] << 8)
+                + ((uint32_t)bytes[2] << 16);
+    }
+    fclose(file);
+}
+
+static void saveFlash(void){
+    FILE* file;
+    uint8_t bytes[4] = {0};
+    uint32_t i;
+
+    if(flashFile == NULL)
+        return;
+
+    file = fopen(flashFile, "wb");
+    if(file == NULL){
+        perror("bootypic-sim: flash file");
+        return;
+    }
+
+    for(i=0; i<flashWords; i++){
+        bytes[0] = (uint8_t)(flash[i] & 0xff);
+        bytes[1] = (uint8_t)((flash[i] >> 8) & 0xff);
+        bytes[2] = (uint8_t)((flash[i] >> 16) & 0xff);
+        fwrite(bytes, 1, 4, file);
+    }
+    fclose(file);
+}
+
+void simExit(int status){
+    double session = 0.0;
+
+    /* let the last reply drain onto the wire */
+    exiting = true;
+    commitTx();
+    while(txCount)
+        simAdvance(SIM_ACCESS_CYCLES);
+
+    if(stats.started)
+        session = (double)(simCycles - stats.firstRx) / FCY;
+
+    fprintf(stderr,
+            "bootypic-sim: %s elapsed=%.6f session=%.6f rx=%u tx=%u "
+            "overruns=%u dropped=%u corrupted=%u erases=%u writes=%u words=%u nvm=%.6f "
+            "baud=%lu\n",
+            PLATFORM_STRING, (double)simCycles / FCY, session,
+            stats.rxBytes, stats.txBytes, stats.overruns, stats.dropped, stats.corrupted,
+            stats.erases, stats.programs, stats.words,
+            (double)stats.nvmCycles / FCY, (unsigned long)((10ULL * FCY) / byteCycles()));
+
+    saveFlash();
+    if(linkPath != NULL)
+        unlink(linkPath);
+
+    exit(status);
+}
+
+static void onSignal(int signal){
+    (void)signal;
+    stopRequested = 1;
+}
+
+void simLineErrors(uint32_t ppm){
+    lineErrorPpm = ppm;
+    srand(1);
+}
+
+void simRequestUpdate(void){
+    bootMailbox[0] = BOOT_MAILBOX_REQUEST;
+    bootMailbox[1] = (uint16_t)~BOOT_MAILBOX_REQUEST;
+}
+
+void simWaitForHost(void){
+    readHost(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+}
+
+int simOpen(bool fast, const char* flashPath, const char* link){
+    struct termios tio;
+    struct sigaction action;
+    const char* slaveName;
+
+    fastMode = fast;
+    flashFile = flashPath;
+    linkPath = link;
+
+    flash = malloc(flashWords * sizeof(uint32_t));
+    if(flash == NULL)
+        return 1;
+    loadFlash();
+
+    ptyFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if((ptyFd < 0) || (grantpt(ptyFd) != 0) || (unlockpt(ptyFd) != 0)){
+        perror("bootypic-sim: pty");
+        return 1;
+    }
+    slaveName = ptsname(ptyFd);
+
+    /* hold the slave open so that the host can reconnect, and put it in raw
+     * mode so that the line discipline does not touch the frames */
+    slaveFd = open(slaveName, O_RDWR | O_NOCTTY);
+    if(slaveFd < 0){
+        perror("bootypic-sim: pty");
+        return 1;
+    }
+    tcgetattr(slaveFd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slaveFd, TCSANOW, &tio);
+
+    if(linkPath != NULL){
+        unlink(linkPath);
+        if(symlink(slaveName, linkPath) != 0){
+            perror("bootypic-sim: link");
+            linkPath = NULL;
+        }
+    }
+
+    printf("%s\n", (linkPath != NULL) ? linkPath : slaveName);
+    fflush(stdout);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &wallStart);
+
+    return 0;
+}
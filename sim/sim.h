@@ -0,0 +1,118 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @brief the number of instruction cycles charged for each register access
+ */
+#define SIM_ACCESS_CYCLES 4
+
+/**
+ * @brief the number of instruction cycles charged for each pass of the main
+ * loop, in addition to the register accesses that it makes
+ */
+#define SIM_LOOP_CYCLES 20
+
+/**
+ * @brief the number of instruction cycles charged for taking an interrupt
+ * and returning from it, in addition to what the handler does
+ */
+#define SIM_ISR_CYCLES 20
+
+/**
+ * @brief loads the flash model and opens the pseudo-terminal that stands in
+ * for the UART, printing its path on stdout
+ * @param fast true to skip pacing the virtual clock to the wall clock
+ * @param flashPath the flash image to load at reset and save on exit, or NULL
+ * @param link a symlink to create to the pseudo-terminal, or NULL
+ * @return 0 on success
+ */
+int simOpen(bool fast, const char* flashPath, const char* link);
+
+/**
+ * @brief corrupts bytes from the host at random, to model a noisy line
+ * @param ppm the number of bytes in every million that have a bit flipped
+ */
+void simLineErrors(uint32_t ppm);
+
+/**
+ * @brief leaves a request in the boot mailbox, as the application does 
+ * before a software reset
+ */
+void simRequestUpdate(void);
+
+/**
+ * @brief holds the device in reset until the host sends its first byte, so
+ * that the bootloader starts with the host already there
+ */
+void simWaitForHost(void);
+
+/**
+ * @brief the current value of the virtual instruction clock
+ */
+extern uint64_t simCycles;
+
+/**
+ * @brief advances the virtual clock and updates the peripheral models
+ * @param cycles the number of instruction cycles to advance
+ */
+void simAdvance(uint64_t cycles);
+
+/**
+ * @brief converts a time in microseconds to instruction cycles
+ * @param us the time in microseconds
+ * @return the number of instruction cycles
+ */
+uint64_t simMicroseconds(uint32_t us);
+
+/**
+ * @brief resets the UART model to the state it has after initUart()
+ */
+void simUartInit(void);
+
+/**
+ * @brief starts TMR1 and TMR2 with the same settings as initTimers() on the
+ * device
+ * @param t1con the T1CON value
+ * @param t2con the T2CON value
+ */
+void simTimersInit(uint16_t t1con, uint16_t t2con);
+
+/**
+ * @brief reads an instruction word from the flash model
+ * @param address the program memory address (must be even)
+ * @return the 24-bit instruction word
+ */
+uint32_t simFlashRead(uint32_t address);
+
+/**
+ * @brief erases the flash page containing the address, stalling the CPU for
+ * the erase time
+ * @param address an address within the page
+ * @param us the page erase time, in microseconds
+ */
+void simFlashErase(uint32_t address, uint32_t us);
+
+/**
+ * @brief programs instruction words into the flash model, stalling the CPU
+ * for the programming time
+ *
+ * Programming can only clear bits, as on the device, so writing to a location
+ * that has not been erased leaves the AND of the old and new values.
+ *
+ * @param address the address of the first instruction (must be even)
+ * @param words the instruction words to program
+ * @param count the number of instruction words
+ * @param us the programming time, in microseconds
+ */
+void simFlashProgram(uint32_t address, uint32_t* words, uint16_t count, uint32_t us);
+
+/**
+ * @brief prints the session summary, saves the flash image, and exits
+ * @param status the exit status
+ */
+void simExit(int status);
+
+#endif
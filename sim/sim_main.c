@@ -0,0 +1,62 @@
+/// Command line entry point of the simulator
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+int bootloaderMain(void);
+
+static void usage(const char* name){
+    fprintf(stderr,
+            "usage: %s [-x] [-r] [-m] [-e ppm] [-f flash.bin] [-l link]\n"
+            "  -x  fast mode: do not pace the virtual clock to the wall clock,\n"
+            "      and do not count time spent waiting on the host\n"
+            "  -r  hold the device in reset until the host sends something\n"
+            "  -m  start with a request from the application in the boot mailbox\n"
+            "  -e  flip a bit in this many of every million bytes from the host\n"
+            "  -f  flash image, loaded at reset and saved on exit\n"
+            "  -l  create a symlink to the pseudo-terminal at this path\n",
+            name);
+}
+
+int main(int argc, char** argv){
+    bool fast = false;
+    bool waitForHost = false;
+    const char* flashFile = NULL;
+    const char* linkPath = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "xrme:f:l:h")) != -1){
+        switch(opt){
+            case 'x':
+                fast = true;
+                break;
+            case 'r':
+                waitForHost = true;
+                break;
+            case 'm':
+                simRequestUpdate();
+                break;
+            case 'e':
+                simLineErrors((uint32_t)strtoul(optarg, NULL, 0));
+                break;
+            case 'f':
+                flashFile = optarg;
+                break;
+            case 'l':
+                linkPath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(simOpen(fast, flashFile, linkPath) != 0)
+        return 1;
+    if(waitForHost)
+        simWaitForHost();
+
+    return bootloaderMain();
+}
@@ -0,0 +1,846 @@
+#!/usr/bin/env python3
+"""Sends each command to the simulator and checks what it did to the flash
+and what it replied, one fresh simulator per test:
+
+    make DEVICE=pic24fj256gb106
+    ./test_commands.py build/pic24fj256gb106/bootypic-sim [test ...]
+
+"make check" runs it for the DEVICE, after test_link.py.  A test of a
+command that the build leaves out is skipped, which for a MINIMAL=1 build,
+without CMD_READ_DESCRIPTOR to report any, is all of the optional ones.
+"""
+
+import contextlib
+import os
+import sys
+import tempfile
+import time
+import zlib
+
+import loader
+import trace2chrome
+
+TESTS = []
+
+
+def test(name, needs=0, restarts=False):
+    """Registers a test of the capabilities needed, which is skipped on a
+    device without them, as it is when it returns None for passed.  A test
+    that restarts the device is given the simulator's path too."""
+    def register(function):
+        TESTS.append((name, needs, restarts, function))
+        return function
+    return register
+
+
+@contextlib.contextmanager
+def device(path, flash=None):
+    """A simulator in fast mode and the identified device on it."""
+    sim = loader.Simulator(path, fast=True, flash=flash)
+    try:
+        dev = loader.Device(loader.Port(sim.pty), sim.baud)
+        dev.identify()
+        yield dev
+        dev.start_app()
+        sim.finish()
+    finally:
+        if sim.process.poll() is None:
+            sim.process.kill()
+            sim.process.communicate()
+
+
+def pattern(address, count):
+    """Instructions that differ from each other and from erased flash."""
+    return [(0x100000 + address + 2 * i) & 0xffffff for i in range(count)]
+
+
+def goto_bootloader(dev):
+    return [0x040000 | dev.boot_start, 0x000000]
+
+
+def erase(dev, address, pages=1):
+    """Erases the pages from the address, waiting for the reply if the
+    device has CMD_ERASE_RANGE, and returns the pages erased and skipped."""
+    if dev.capabilities & loader.CAP_ERASE_RANGE:
+        return dev.erase_range(address, address + 2 * pages * dev.page_len, 0.05)
+    for page in range(pages):
+        dev.erase_page(address + 2 * page * dev.page_len)
+        settle()
+    return pages, 0
+
+
+def read(dev, address, count):
+    """Reads the instructions, a frame at a time without CMD_READ_RANGE."""
+    if dev.capabilities & loader.CAP_READ_RANGE:
+        return dev.read_range(address, count)
+    words = []
+    for offset in range(0, 2 * count, 2 * dev.max_prog_size):
+        words += dev.read_max(address + offset)
+    return words[:count]
+
+
+def status_of(dev, cmd, payload=b''):
+    """Sends a command and returns the status it was refused with, or
+    STATUS_OK for any other reply."""
+    dev.send(cmd, payload)
+    while True:
+        reply_cmd, reply = dev.receive()
+        if reply_cmd == loader.CMD_STATUS and reply[1] == cmd:
+            return reply[0]
+        if reply_cmd == cmd:
+            # the rest of a stream of replies is passed over
+            settle()
+            dev.pending.clear()
+            return loader.STATUS_OK
+
+
+def refuses(dev, cases, status):
+    """Checks that each (cmd, payload, name) is refused with the status,
+    returning the (passed, detail) of a test."""
+    for cmd, payload, name in cases:
+        got = status_of(dev, cmd, payload)
+        if got != status:
+            return False, '{} answered with status {}'.format(name, got)
+    return True, '{} refused'.format(', '.join(name for _, _, name in cases))
+
+
+def words_detail(expected, got):
+    if got == expected:
+        return 'read back as written'
+    for i, (want, have) in enumerate(zip(expected, got)):
+        if want != have:
+            return 'differs at instruction {} of {}'.format(i, len(expected))
+    return 'read back {} instructions of {}'.format(len(got), len(expected))
+
+
+def settle():
+    """Waits out a command that doesn't reply.  Whatever arrives while the
+    flash stalls the CPU overruns the UART, as it would on the device."""
+    time.sleep(0.05)
+
+
+@test('row write at 0')
+def row_write_at_zero(dev):
+    erase(dev, 0)
+    words = pattern(0, dev.row_len)
+    dev.write_row(0, words)
+    settle()
+    expected = goto_bootloader(dev) + words[2:]
+    got = read(dev, 0, dev.row_len)
+    return got == expected, 'vectors written, reset vector kept' if got == expected else \
+        'read back {}'.format(' '.join('{:06x}'.format(word) for word in got[:4]))
+
+
+@test('read range', needs=loader.CAP_READ_RANGE)
+def read_range(dev):
+    # a little over two frames, from part way into a frame
+    address = dev.app_start
+    erase(dev, address, 3 * dev.max_prog_size // dev.page_len + 1)
+    for offset in range(0, 3 * 2 * dev.max_prog_size, 2 * dev.max_prog_size):
+        dev.write_max(address + offset, pattern(address + offset, dev.max_prog_size))
+        settle()
+    start, count = address + 6, 2 * dev.max_prog_size + 5
+    got = dev.read_range(start, count)
+    expected = pattern(start, count)
+    return got == expected, words_detail(expected, got)
+
+
+@test('read range bounds', needs=loader.CAP_READ_RANGE)
+def read_range_bounds(dev):
+    if dev.read_range(dev.prog_len - 2, 1) != [0xffffff]:
+        return False, 'the last instruction could not be read'
+    return refuses(dev, ((loader.CMD_READ_RANGE, loader.u32(dev.prog_len - 2) + loader.u32(2),
+                          'past the end'),
+                         (loader.CMD_READ_RANGE, loader.u32(dev.prog_len) + loader.u32(1),
+                          'at the end'),
+                         (loader.CMD_READ_RANGE, loader.u32(0) + loader.u32(0x800000),
+                          'a huge count')), loader.STATUS_LENGTH)
+
+
+@test('crc', needs=loader.CAP_CRC)
+def crc(dev):
+    address = dev.app_start
+    erase(dev, address)
+    words = pattern(address, dev.row_len)
+    dev.write_row(address, words)
+    settle()
+    # a range that runs on into erased flash
+    expected = zlib.crc32(loader.pack_words(words + [0xffffff] * 3))
+    got = dev.read_crc(address, dev.row_len + 3)
+    return got == expected, 'crc {:08x}, expected {:08x}'.format(got, expected)
+
+
+@test('crc bounds', needs=loader.CAP_CRC)
+def crc_bounds(dev):
+    if dev.read_crc(dev.prog_len - 2, 1) != zlib.crc32(b'\xff\xff\xff'):
+        return False, 'the last instruction has the wrong crc'
+    return refuses(dev, ((loader.CMD_READ_CRC, loader.u32(dev.prog_len - 2) + loader.u32(2),
+                          'past the end'),
+                         (loader.CMD_READ_CRC, loader.u32(dev.prog_len) + loader.u32(0),
+                          'at the end'),
+                         (loader.CMD_READ_CRC, loader.u32(0) + loader.u32(0xffffffff),
+                          'a huge count')), loader.STATUS_LENGTH)
+
+
+# the ports that keep their configuration words in the last page of flash,
+# and so define CONFIG_PAGE_ADDRESS
+CONFIG_PAGE_PLATFORMS = ('pic24fj256gb106', 'dspic33ep32mc204', 'dspic33ep64mc504')
+
+
+def config_page(dev):
+    return dev.prog_len - 2 * dev.page_len
+
+
+@test('erase range', needs=loader.CAP_ERASE_RANGE)
+def erase_range(dev):
+    # the first page that the application has to itself; on the
+    # dsPIC33EP64MC504 the bootloader runs on into the page at app_start
+    span = 2 * dev.page_len
+    first, last = -(-dev.app_start // span) * span, config_page(dev)
+    for address in (first, last):
+        dev.write_row(address, pattern(address, dev.row_len))
+        settle()
+    pages = (dev.prog_len - first) // span
+    erased, skipped = erase(dev, first, pages)
+
+    kept = dev.platform in CONFIG_PAGE_PLATFORMS
+    expected = pattern(last, dev.row_len) if kept else [0xffffff] * dev.row_len
+    if read(dev, first, dev.row_len) != [0xffffff] * dev.row_len:
+        return False, 'the first page was not erased'
+    if read(dev, last, dev.row_len) != expected:
+        return False, 'the last page was {}'.format('erased' if kept else 'kept')
+    if erased + skipped != pages - kept:
+        return False, '{} pages reported of {}'.format(erased + skipped, pages - kept)
+    return True, '{} pages erased, the last {}'.format(erased, 'kept' if kept else 'erased')
+
+
+@test('load over the last page', needs=loader.CAP_ERASE_RANGE | loader.CAP_SEQUENCED)
+def load_last_page(dev):
+    last = config_page(dev)
+    dev.write_row(last, [0] * dev.row_len)
+    settle()
+    image = {dev.app_start + 2 * i: word
+             for i, word in enumerate(pattern(dev.app_start, dev.row_len))}
+    image.update({last + 2 * i: word for i, word in enumerate(pattern(last, dev.row_len))})
+    _, _, mismatches = loader.load(dev, image, 0.05, 0.01, window=4, log=lambda *args: None)
+    return mismatches == 0, '{} mismatched instructions'.format(mismatches)
+
+
+@test('write session', needs=loader.CAP_SESSION)
+def write_session(dev):
+    span = 2 * dev.max_prog_size
+    address = -(-dev.app_start // span) * span
+    erase(dev, address, 3 * dev.max_prog_size // dev.page_len + 1)
+    writes = {address + i * span: pattern(address + i * span, dev.max_prog_size)
+              for i in range(3)}
+    loader.write_sessions(dev, writes, 2)
+    expected = pattern(address, 3 * dev.max_prog_size)
+    got = read(dev, address, len(expected))
+    return got == expected, words_detail(expected, got)
+
+
+@test('write session bounds', needs=loader.CAP_SESSION)
+def write_session_bounds(dev):
+    span = 2 * dev.max_prog_size
+    cases = [(loader.CMD_WRITE_SESSION_OPEN, loader.u32(dev.app_start + 2),
+              'an open off a frame boundary')]
+    if dev.row_len < dev.max_prog_size:
+        cases.append((loader.CMD_WRITE_SESSION_OPEN, loader.u32(dev.app_start + 2 * dev.row_len),
+                      'an open on a row but off a frame'))
+    passed, detail = refuses(dev, cases, loader.STATUS_LENGTH)
+    if not passed:
+        return passed, detail
+
+    # the frame that would run into the bootloader is refused
+    dev.query(loader.CMD_WRITE_SESSION_OPEN, loader.u32(dev.boot_start - span))
+    statuses = []
+    for seq in range(2):
+        dev.write_session(seq, [0xffffff] * dev.max_prog_size)
+        statuses.append(dev.write_reply()[0])
+    dev.query(loader.CMD_WRITE_SESSION_CLOSE)
+    if statuses != [loader.STATUS_OK, loader.STATUS_PROTECTED]:
+        return False, 'frames up to the bootloader answered with {}'.format(statuses)
+    return True, detail + ', the bootloader kept'
+
+
+@test('erase page off its boundary')
+def erase_page_unaligned(dev):
+    span = 2 * dev.page_len
+    address = -(-dev.app_start // span) * span
+    # only the start of the page is programmed, ahead of the address given
+    words = pattern(address, 8) + [0xffffff] * (dev.row_len - 8)
+    dev.write_row(address, words)
+    settle()
+    dev.erase_page(address + 16)
+    settle()
+    got = read(dev, address, dev.row_len)
+    return got == [0xffffff] * dev.row_len, 'page erased' if got[0] == 0xffffff else \
+        'the start of the page was left programmed'
+
+
+@test('erase page 0 off its boundary')
+def erase_page_zero_unaligned(dev):
+    dev.erase_page(0x10)
+    settle()
+    if read(dev, 0, 2) != goto_bootloader(dev):
+        return False, 'the jump to the bootloader was not put back'
+    if dev.capabilities & loader.CAP_RX_INTERRUPT:
+        if read(dev, loader.U1RX_AIVT_ADDRESS, 1) == [0xffffff]:
+            return False, 'the U1RX vector was left blank'
+        dev.identify()
+        return True, 'reset and U1RX vectors put back'
+    return True, 'reset vector put back'
+
+
+@test('short frame')
+def short_frame(dev):
+    # the descriptor request leaves its command in the receive buffer, where
+    # a frame too short to carry one would find it
+    dev.read_rx_errors()
+    dev.port.write(bytes((loader.START_OF_FRAME, 0x01, loader.END_OF_FRAME)))
+    cmd, reply = dev.receive()
+    expected = bytes((loader.STATUS_LENGTH, loader.CMD_STATUS))
+    return (cmd, reply[:2]) == (loader.CMD_STATUS, expected), \
+        'answered with 0x{:02x} {}'.format(cmd, reply.hex())
+
+
+@test('app record length')
+def app_record_length(dev):
+    # an empty payload is too short for the command, unless it isn't built in
+    built = dev.capabilities & loader.CAP_APP_RECORD
+    expected = loader.STATUS_LENGTH if built else loader.STATUS_UNKNOWN_COMMAND
+    got = status_of(dev, loader.CMD_WRITE_APP_RECORD)
+    return got == expected, 'refused with status {}, expected {}'.format(got, expected)
+
+
+@test('startup with a record', needs=loader.CAP_APP_RECORD, restarts=True)
+def startup_recorded(dev, path):
+    # a record of the whole application space keeps the startup check busy
+    # for as long as it can be
+    count = (dev.prog_len - dev.app_start) // 2
+    crc = zlib.crc32(b'\xff\xff\xff' * count)
+    burst = loader.encode_frame(loader.CMD_READ_DESCRIPTOR) * 8
+    with tempfile.TemporaryDirectory() as directory:
+        flash = os.path.join(directory, 'flash.bin')
+        with device(path, flash) as first:
+            first.write_app_record(count, crc)
+
+        # a host that calls the device across its reset, as --sync does
+        sim = loader.Simulator(path, fast=True, flash=flash, wake=burst)
+        try:
+            woken = loader.Device(sim.port, sim.baud)
+            replies = 0
+            while True:
+                try:
+                    cmd, _ = woken.receive(timeout=0.5)
+                except loader.ProtocolError:
+                    break
+                replies += cmd == loader.CMD_READ_DESCRIPTOR
+            overruns, _ = woken.read_rx_errors()
+            woken.start_app()
+            sim.finish()
+        finally:
+            if sim.process.poll() is None:
+                sim.process.kill()
+                sim.process.communicate()
+    return (replies, overruns) == (8, 0), \
+        '{} of 8 replies, {} overruns while the record was checked'.format(replies, overruns)
+
+
+@test('row write and read back')
+def row_write_read(dev):
+    span = 2 * dev.page_len
+    address = -(-dev.app_start // span) * span
+    dev.erase_page(address)
+    settle()
+    words = pattern(address, dev.row_len)
+    dev.write_row(address, words)
+    settle()
+    got = dev.read_max(address)[:dev.row_len]
+    if got != words:
+        return False, 'CMD_READ_MAX ' + words_detail(words, got)
+    single = loader.bytes_to_words(dev.query(loader.CMD_READ_ADDR, loader.u32(address + 2)))
+    if single != [address + 2, words[1]]:
+        return False, 'CMD_READ_ADDR answered {}'.format(single)
+    return True, 'CMD_READ_MAX and CMD_READ_ADDR read back what was written'
+
+
+@test('bootloader protected')
+def bootloader_protected(dev):
+    before = read(dev, dev.boot_start, dev.row_len)
+    dev.write_row(dev.boot_start, [0] * dev.row_len)
+    dev.erase_page(dev.boot_start)
+    settle()
+    got = read(dev, dev.boot_start, dev.row_len)
+    return got == before, 'the bootloader kept' if got == before else 'the bootloader was changed'
+
+
+
+@test('escaped frame among noise')
+def escaped_frame_noise(dev):
+    span = 2 * dev.page_len
+    address = -(-dev.app_start // span) * span
+    erase(dev, address)
+    # every byte that has to be escaped, in every position
+    words = [0xf77ff6, 0x7ff6f7, 0xf6f77f] * (dev.row_len // 3) + [0xf7f7f7] * (dev.row_len % 3)
+    frame = loader.encode_frame(loader.CMD_WRITE_ROW, loader.u32(address) + loader.words_to_bytes(words))
+    noise = bytes((0x55, loader.END_OF_FRAME, 0x00, loader.ESC, 0x13))
+
+    # the frame a byte at a time, between bytes that can't start one
+    dev.port.write(noise)
+    for byte in frame:
+        dev.port.write(bytes((byte,)))
+    dev.port.write(noise)
+    settle()
+    got = read(dev, address, dev.row_len)
+    return got == words, words_detail(words, got)
+
+
+
+@test('back to back frames')
+def back_to_back(dev):
+    cmds = (loader.CMD_READ_VERSION, loader.CMD_READ_ROW_LEN, loader.CMD_READ_PAGE_LEN,
+            loader.CMD_READ_PROG_LEN, loader.CMD_READ_PLATFORM, loader.CMD_READ_RX_ERRORS)
+    dev.port.write(b''.join(loader.encode_frame(cmd) for cmd in cmds))
+    got = tuple(dev.receive()[0] for _ in cmds)
+    if got != cmds:
+        return False, 'replies to {}'.format(' '.join('0x{:02x}'.format(cmd) for cmd in got))
+
+    # a frame too long for the buffer is refused, and the one behind it isn't
+    # held up by it
+    oversized = loader.encode_frame(loader.CMD_WRITE_MAX_PROG_SIZE,
+                                    bytes(4 + 4 * dev.max_prog_size + 64))
+    dev.port.write(oversized + loader.encode_frame(loader.CMD_READ_VERSION))
+    statuses = []
+    while True:
+        cmd, reply = dev.receive()
+        if cmd == loader.CMD_READ_VERSION:
+            break
+        statuses.append(reply[0])
+    if statuses != [loader.STATUS_LENGTH]:
+        return False, 'the oversized frame answered with {}'.format(statuses)
+    return True, '{} frames in one write answered in order, an oversized one refused'.format(len(cmds))
+
+
+
+@test('sequenced writes', needs=loader.CAP_SEQUENCED)
+def sequenced_writes(dev):
+    start = dev.app_start
+    erase(dev, start)
+    rows = [pattern(start + 2 * i * dev.row_len, dev.row_len) for i in range(3)]
+    dev.send(loader.CMD_WRITE_SEQ_RESET)
+    if dev.write_reply() != (loader.STATUS_OK, 0):
+        return False, 'CMD_WRITE_SEQ_RESET not acknowledged'
+
+    # the first frame is written, one from ahead of it is refused with the
+    # one expected, and the first again is acknowledged without moving on
+    steps = ((0, 0, (loader.STATUS_OK, 1)),
+             (2, 2, (loader.STATUS_OUT_OF_ORDER, 1)),
+             (0, 0, (loader.STATUS_OK, 1)),
+             (1, 1, (loader.STATUS_OK, 2)))
+    for seq, row, expected in steps:
+        dev.write_seq(seq, start + 2 * row * dev.row_len, rows[row])
+        got = dev.write_reply(timeout=dev.timeout + 0.05)
+        if got != expected:
+            return False, 'frame {} answered with status {}, next {}'.format(seq, *got)
+
+    expected = rows[0] + rows[1] + [0xffffff] * dev.row_len
+    got = read(dev, start, 3 * dev.row_len)
+    if got != expected:
+        return False, words_detail(expected, got)
+    return True, 'a frame ahead refused, a repeated one acknowledged again'
+
+
+
+@test('checksum and unknown command')
+def checksum_unknown(dev):
+    start = dev.app_start
+    erase(dev, start)
+    words = pattern(start, dev.row_len)
+    dev.write_row(start, words)
+    settle()
+
+    # an erase with its address changed on the way is refused, not acted on
+    frame = bytearray(loader.encode_frame(loader.CMD_ERASE_PAGE, loader.u32(start)))
+    frame[5] ^= 0x01
+    dev.port.write(bytes(frame))
+    cmd, reply = dev.receive()
+    if cmd != loader.CMD_STATUS or tuple(reply[0:2]) != (loader.STATUS_CHECKSUM, loader.CMD_ERASE_PAGE):
+        return False, 'the corrupted erase answered with 0x{:02x} {}'.format(cmd, reply.hex())
+    settle()
+    got = read(dev, start, dev.row_len)
+    if got != words:
+        return False, 'the corrupted erase ran: ' + words_detail(words, got)
+
+    status = status_of(dev, 0x70)
+    if status != loader.STATUS_UNKNOWN_COMMAND:
+        return False, 'command 0x70 answered with status {}'.format(status)
+    return True, 'a corrupted erase refused and not run, an unknown command refused'
+
+
+
+# the commands that each capability brings with it
+CAPABILITY_COMMANDS = (
+    (loader.CAP_SEQUENCED, (loader.CMD_WRITE_SEQ_RESET, loader.CMD_WRITE_ROW_SEQ,
+                            loader.CMD_WRITE_MAX_SEQ)),
+    (loader.CAP_PACKED, (loader.CMD_READ_MAX_PACKED, loader.CMD_WRITE_ROW_PACKED,
+                         loader.CMD_WRITE_MAX_PACKED)),
+    (loader.CAP_CRC, (loader.CMD_READ_CRC,)),
+    (loader.CAP_SET_BAUD, (loader.CMD_SET_BAUD,)),
+    (loader.CAP_APP_RECORD, (loader.CMD_WRITE_APP_RECORD,)),
+    (loader.CAP_STATS, (loader.CMD_READ_STATS,)),
+    (loader.CAP_TRACE, (loader.CMD_READ_TRACE,)),
+    (loader.CAP_READ_RANGE, (loader.CMD_READ_RANGE,)),
+    (loader.CAP_COBS, (loader.CMD_SET_FRAMING,)),
+    (loader.CAP_ERASE_RANGE, (loader.CMD_ERASE_RANGE,)),
+    (loader.CAP_READ_SKIPPED, (loader.CMD_READ_SKIPPED,)),
+    (loader.CAP_SESSION, (loader.CMD_WRITE_SESSION_OPEN, loader.CMD_WRITE_SESSION,
+                          loader.CMD_WRITE_SESSION_CLOSE)),
+)
+
+
+@test('left-out commands')
+def left_out_commands(dev):
+    cases = [(cmd, b'', 'command 0x{:02x}'.format(cmd))
+             for capability, cmds in CAPABILITY_COMMANDS
+             if not dev.capabilities & capability for cmd in cmds]
+    if dev.rx_buf_len is None:
+        cases.append((loader.CMD_READ_DESCRIPTOR, b'', 'CMD_READ_DESCRIPTOR'))
+    if not cases:
+        return True, 'nothing left out'
+    passed, detail = refuses(dev, cases, loader.STATUS_UNKNOWN_COMMAND)
+    if not passed:
+        return False, detail
+    return True, 'each of {} left out refused as unknown'.format(len(cases))
+
+
+
+@test('packed write and read', needs=loader.CAP_PACKED)
+def packed_write_read(dev):
+    start = dev.app_start
+    erase(dev, start, 2)
+    row = pattern(start, dev.row_len)
+    max_start = start + 2 * dev.row_len
+    burst = pattern(max_start, dev.max_prog_size)
+    dev.send(loader.CMD_WRITE_SEQ_RESET)
+    dev.write_reply()
+    for seq, (address, words, write_max) in enumerate(((start, row, False),
+                                                        (max_start, burst, True))):
+        dev.write_seq(seq, address, words, write_max=write_max, packed=True)
+        status, _ = dev.write_reply(timeout=dev.timeout + 0.1)
+        if status != loader.STATUS_OK:
+            return False, 'packed write {} answered with status {}'.format(seq, status)
+
+    expected = row + burst
+    got = []
+    for offset in range(0, 2 * len(expected), 2 * dev.max_prog_size):
+        got += dev.read_max(start + offset, packed=True)
+    got = got[:len(expected)]
+    if got != expected:
+        return False, words_detail(expected, got)
+    unpacked = dev.read_max(start)
+    if unpacked != got[:len(unpacked)]:
+        return False, 'the unpacked read ' + words_detail(got[:len(unpacked)], unpacked)
+    return True, 'a row and a MAX_PROG_SIZE written and read back packed'
+
+
+
+@test('crc across pages', needs=loader.CAP_CRC)
+def crc_pages(dev):
+    # rows either side of a page boundary, summed from part way into the
+    # first over more than one READ_BLOCK_LEN, and then not at all
+    boundary = dev.app_start + 2 * dev.page_len
+    erase(dev, dev.app_start, 2)
+    below = pattern(boundary - 2 * dev.row_len, dev.row_len)
+    above = pattern(boundary, dev.row_len)
+    dev.write_row(boundary - 2 * dev.row_len, below)
+    settle()
+    dev.write_row(boundary, above)
+    settle()
+    words = below[5:] + above + [0xffffff] * 7
+    cases = ((boundary - 2 * dev.row_len + 10, words), (boundary, []))
+    for address, expected_words in cases:
+        expected = zlib.crc32(loader.pack_words(expected_words))
+        got = dev.read_crc(address, len(expected_words))
+        if got != expected:
+            return False, '{} from 0x{:x}: crc {:08x}, expected {:08x}'.format(
+                len(expected_words), address, got, expected)
+    return True, '{} across a page boundary, and none, summed as zlib does'.format(len(words))
+
+
+
+@test('descriptor')
+def descriptor(dev):
+    if dev.rx_buf_len is None:
+        return None, 'not built in'
+    fields = (('platform', dev.platform, dev.read_string(loader.CMD_READ_PLATFORM)),
+              ('version', dev.version, dev.read_string(loader.CMD_READ_VERSION)),
+              ('row length', dev.row_len, dev.read_u16(loader.CMD_READ_ROW_LEN)),
+              ('page length', dev.page_len, dev.read_u16(loader.CMD_READ_PAGE_LEN)),
+              ('program length', dev.prog_len, dev.read_u32(loader.CMD_READ_PROG_LEN)),
+              ('MAX_PROG_SIZE', dev.max_prog_size, dev.read_u16(loader.CMD_READ_MAX_PROG_SIZE)),
+              ('application start', dev.app_start, dev.read_u16(loader.CMD_READ_APP_START_ADDR)),
+              ('bootloader start', dev.boot_start, dev.read_u16(loader.CMD_READ_BOOT_START_ADDR)))
+    for name, described, read in fields:
+        if described != read:
+            return False, 'the {} is {} in the descriptor, {} read alone'.format(name, described, read)
+    # the length, command, sequence number, address and checksum around the
+    # instructions of the longest write
+    if dev.rx_buf_len < 4 * dev.max_prog_size + 11:
+        return False, 'RX_BUF_LEN {} is too short for a MAX_PROG_SIZE write'.format(dev.rx_buf_len)
+    return True, 'matches the {} commands it stands in for'.format(len(fields))
+
+
+
+@test('mailbox', needs=loader.CAP_APP_RECORD, restarts=True)
+def mailbox(dev, path):
+    # a recorded application that is started at once when no host calls,
+    # unless it asked for the bootloader
+    count = (dev.prog_len - dev.app_start) // 2
+    crc = zlib.crc32(b'\xff\xff\xff' * count)
+    with tempfile.TemporaryDirectory() as directory:
+        flash = os.path.join(directory, 'flash.bin')
+        with device(path, flash) as first:
+            first.write_app_record(count, crc)
+
+        results = []
+        for requested in (False, True):
+            sim = loader.Simulator(path, flash=flash, wake=None, mailbox=requested)
+            try:
+                time.sleep(0.5)
+                resident = sim.process.poll() is None
+                if resident:
+                    woken = loader.Device(sim.port, sim.baud)
+                    woken.query(loader.CMD_READ_VERSION)
+                    woken.start_app()
+                sim.finish()
+            finally:
+                if sim.process.poll() is None:
+                    sim.process.kill()
+                    sim.process.communicate()
+            results.append(resident)
+    return results == [False, True], 'without a request the {}, with one the {}'.format(
+        *('bootloader stayed' if resident else 'application started' for resident in results))
+
+
+
+@test('stats', needs=loader.CAP_STATS)
+def stats(dev):
+    start = dev.app_start
+    dev.write_row(start, pattern(start, dev.row_len))
+    settle()
+    frame = bytearray(loader.encode_frame(loader.CMD_READ_VERSION))
+    frame[-2] ^= 0x01
+    dev.port.write(bytes(frame))
+    dev.receive()
+
+    counted = dev.read_stats()
+    writes = counted['nvm']['row'][0] + counted['nvm']['double word'][0]
+    commands = counted['commands'].get(loader.CMD_WRITE_ROW, (0, 0, 0))
+    if counted['checksums'] != 1:
+        return False, '{} checksum failures counted'.format(counted['checksums'])
+    if commands[0] != 1 or not commands[2] > 0:
+        return False, 'CMD_WRITE_ROW counted {} times, longest {}s'.format(commands[0], commands[2])
+    if not writes or not counted['decode'] > 0:
+        return False, '{} flash writes counted, {}s decoding'.format(writes, counted['decode'])
+    return True, 'the row write, its flash time and the checksum failure counted'
+
+
+
+@test('trace', needs=loader.CAP_TRACE)
+def trace(dev):
+    dev.read_trace()
+    start = dev.app_start
+    dev.write_row(start, pattern(start, dev.row_len))
+    settle()
+    _, lost, records = trace2chrome.read_records(dev.read_trace())
+    events = [(event, arg & 0xff) for _, event, arg in records]
+    try:
+        decoded = events.index((trace2chrome.TRACE_DECODE_DONE, loader.CMD_WRITE_ROW))
+        ended = events.index((trace2chrome.TRACE_COMMAND_END, loader.CMD_WRITE_ROW), decoded)
+    except ValueError:
+        return False, 'no CMD_WRITE_ROW in {} records'.format(len(records))
+    flash = [event for event, _ in events[decoded:ended]
+             if event in (trace2chrome.TRACE_NVM_START, trace2chrome.TRACE_NVM_END)]
+    pair = [trace2chrome.TRACE_NVM_START, trace2chrome.TRACE_NVM_END]
+    if not flash or flash != pair * (len(flash) // 2):
+        return False, 'the flash events of the write were {}'.format(flash)
+    times = [time for time, _, _ in records]
+    if lost or times != sorted(times):
+        return False, '{} records lost, {} in order'.format(lost, 'all' if times == sorted(times) else 'not')
+    return True, 'the row write and its flash time traced in order'
+
+
+
+@test('blank page skipped', needs=loader.CAP_READ_SKIPPED)
+def blank_page_skipped(dev):
+    # the page is blank to start with, and then isn't
+    start = dev.app_start
+    dev.erase_page(start)
+    settle()
+    first = dev.read_skipped()[0]
+    dev.write_row(start, pattern(start, dev.row_len))
+    settle()
+    dev.erase_page(start)
+    settle()
+    second = dev.read_skipped()[0]
+    if (first, second) != (1, 1):
+        return False, '{} then {} erases skipped'.format(first, second)
+    got = read(dev, start, dev.row_len)
+    if got != [0xffffff] * dev.row_len:
+        return False, 'the written page was not erased'
+    return True, 'the blank page skipped, the written one erased'
+
+
+
+@test('matching row skipped', needs=loader.CAP_READ_SKIPPED)
+def matching_row_skipped(dev):
+    # a row resent as it is, and a blank row over blank flash
+    start = dev.app_start
+    words = pattern(start, dev.row_len)
+    for address, row in ((start, words), (start, words),
+                         (start + 2 * dev.row_len, [0xffffff] * dev.row_len)):
+        dev.write_row(address, row)
+        settle()
+    skipped = dev.read_skipped()[1]
+    if skipped != 2:
+        return False, '{} of 2 row writes skipped'.format(skipped)
+    expected = words + [0xffffff] * dev.row_len
+    got = read(dev, start, 2 * dev.row_len)
+    return got == expected, 'the resent and the blank row skipped, ' + words_detail(expected, got)
+
+
+
+@test('write max prog size')
+def write_max_prog_size(dev):
+    start = dev.app_start
+    erase(dev, start, -(-2 * dev.max_prog_size // (2 * dev.page_len)))
+    words = pattern(start, dev.max_prog_size)
+    dev.write_max(start, words)
+    settle()
+    # every row of it, and nothing past it
+    expected = words + [0xffffff] * dev.row_len
+    got = read(dev, start, len(expected))
+    return got == expected, '{} instructions, {}'.format(dev.max_prog_size, words_detail(expected, got))
+
+
+
+@test('double word time', needs=loader.CAP_STATS)
+def double_word_time(dev):
+    # the reset vector is written again after page 0 is erased; the
+    # PIC24FV16KM202 has no double word programming, so it takes a row cycle
+    dev.write_row(dev.app_start, pattern(dev.app_start, dev.row_len))
+    settle()
+    dev.erase_page(0)
+    settle()
+    nvm = dev.read_stats()['nvm']
+    double, row = nvm['double word'][2], nvm['row'][2]
+    whole_row = dev.platform == 'pic24fv16km202'
+    passed = 0.5 * row < double < 1.5 * row if whole_row else 0 < double < 0.25 * row
+    return passed, 'double word {:.3f}ms, row {:.3f}ms'.format(1000 * double, 1000 * row)
+
+
+
+@test('frames behind a row write')
+def frames_behind_write(dev):
+    # the dsPIC33EP ports program a row as double words, emptying the UART
+    # between them; the PIC24F ones stall for the whole row and overrun
+    if not dev.platform.startswith('dspic33'):
+        return None, 'the row stalls the CPU throughout'
+    start = dev.app_start
+    words = pattern(start, dev.row_len)
+    burst = 4
+    dev.port.write(loader.encode_frame(loader.CMD_WRITE_ROW, loader.u32(start)
+                                       + loader.words_to_bytes(words))
+                   + loader.encode_frame(loader.CMD_READ_VERSION) * burst)
+    replies = 0
+    while replies < burst:
+        try:
+            cmd, _ = dev.receive()
+        except loader.ProtocolError:
+            break
+        replies += cmd == loader.CMD_READ_VERSION
+    overruns, _ = dev.read_rx_errors()
+    got = read(dev, start, dev.row_len)
+    if got != words:
+        return False, words_detail(words, got)
+    return (replies, overruns) == (burst, 0), \
+        '{} of {} replies, {} overruns behind the row'.format(replies, burst, overruns)
+
+
+
+@test('burst behind a blank erase', needs=loader.CAP_RX_INTERRUPT | loader.CAP_ERASE_RANGE)
+def burst_blank_erase(dev):
+    # the blank check reads each page without waiting on the UART, which the
+    # U1RX interrupt empties meanwhile
+    end = dev.app_start + 8 * 2 * dev.page_len
+    burst = 8
+    dev.read_rx_errors()
+    dev.port.write(loader.encode_frame(loader.CMD_ERASE_RANGE, loader.u32(dev.app_start)
+                                       + loader.u32(end))
+                   + loader.encode_frame(loader.CMD_READ_DESCRIPTOR) * burst)
+    replies, skipped = 0, None
+    while replies < burst:
+        try:
+            cmd, reply = dev.receive()
+        except loader.ProtocolError:
+            break
+        if cmd == loader.CMD_ERASE_RANGE:
+            skipped = int.from_bytes(reply[2:4], 'little')
+        replies += cmd == loader.CMD_READ_DESCRIPTOR
+    overruns, dropped = dev.read_rx_errors()
+    if skipped != 8:
+        return False, 'the erase skipped {} of 8 blank pages'.format(skipped)
+    return (replies, overruns, dropped) == (burst, 0, 0), \
+        '{} of {} replies, {} overruns, {} dropped'.format(replies, burst, overruns, dropped)
+
+
+
+@test('replies queued in order')
+def replies_in_order(dev):
+    # replies longer than TX_RING_LEN, each with a short one behind it,
+    # sent before the first has gone out
+    start = dev.app_start
+    words = pattern(start, dev.max_prog_size)
+    dev.write_max(start, words)
+    settle()
+    frames = [(loader.CMD_READ_MAX, loader.u32(start)), (loader.CMD_READ_VERSION, b''),
+              (loader.CMD_READ_MAX, loader.u32(start)), (loader.CMD_READ_ROW_LEN, b'')]
+    dev.port.write(b''.join(loader.encode_frame(cmd, payload) for cmd, payload in frames))
+    replies = [dev.receive() for _ in frames]
+    got = tuple(cmd for cmd, _ in replies)
+    if got != tuple(cmd for cmd, _ in frames):
+        return False, 'replies to {}'.format(' '.join('0x{:02x}'.format(cmd) for cmd in got))
+    for cmd, reply in replies:
+        if cmd == loader.CMD_READ_MAX and loader.bytes_to_words(reply)[1:] != words:
+            return False, 'a readback ' + words_detail(words, loader.bytes_to_words(reply)[1:])
+    if replies[1][1].rstrip(b'\0').decode() != dev.version:
+        return False, 'the version read {!r}'.format(replies[1][1])
+    return True, '{} replies intact and in order'.format(len(frames))
+
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('usage: test_commands.py <simulator> [test ...]')
+
+    failed = 0
+    for name, needs, restarts, function in TESTS:
+        if len(sys.argv) > 2 and name not in sys.argv[2:]:
+            continue
+        try:
+            with device(sys.argv[1]) as dev:
+                if dev.capabilities & needs != needs:
+                    print('{:<32} skipped  (not built in)'.format(name))
+                    continue
+                passed, detail = function(dev, sys.argv[1]) if restarts else function(dev)
+        except loader.ProtocolError as error:
+            passed, detail = False, str(error)
+        result = 'skipped' if passed is None else 'ok' if passed else 'FAILED'
+        print('{:<32} {}  ({})'.format(name, result, detail))
+        failed += passed is False
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Checks that CMD_SET_BAUD and CMD_SET_FRAMING keep a change that is
+confirmed, and fall back on their own from one that isn't.
+
+For the second, nothing intact arrives after each change, only line noise or
+frames in the old framing, which keep the receiver busy for longer than
+BAUD_CONFIRM_TIME.  The device has to go back to the settings it had before
+all the same:
+
+    make DEVICE=pic24fj256gb106
+    ./test_link.py build/pic24fj256gb106/bootypic-sim
+
+"make check" does both for the DEVICE, skipping each on a build without the
+command.
+"""
+
+import sys
+import time
+
+import loader
+
+# longer than BAUD_CONFIRM_TIME counted in TMR2 periods on every port; the
+# pic24fj256gb106 takes 0.213 s a period but runs at 0.8 s, so the baud rate
+# is confirmed for up to 2.4 s there
+NOISE_TIME = 4
+
+
+def noise(dev, data):
+    """Keeps sending data for NOISE_TIME, faster than a TMR2 period."""
+    deadline = time.monotonic() + NOISE_TIME
+    while time.monotonic() < deadline:
+        dev.port.write(data)
+        time.sleep(0.01)
+    dev.port.read(0.1)
+    dev.pending.clear()
+
+
+def skip(sim, dev):
+    dev.start_app()
+    sim.finish()
+    return None, 'not built in'
+
+
+def baud_changes(path):
+    sim = loader.Simulator(path)
+    dev = loader.Device(loader.Port(sim.pty), sim.baud)
+    dev.identify()
+    if not dev.capabilities & loader.CAP_SET_BAUD:
+        return skip(sim, dev)
+    baud = dev.set_baud(4 * sim.baud)
+
+    # well past BAUD_CONFIRM_TIME, the device still answers at the new rate
+    time.sleep(NOISE_TIME)
+    try:
+        dev.query(loader.CMD_READ_VERSION, retries=0)
+    except loader.ProtocolError:
+        return False, 'stopped answering after the change'
+    dev.start_app()
+    ended = int(sim.finish()['baud'])
+    return ended == baud != sim.baud, 'ended at {} baud, asked for {}'.format(ended, 4 * sim.baud)
+
+
+def baud_falls_back(path):
+    sim = loader.Simulator(path)
+    dev = loader.Device(loader.Port(sim.pty), sim.baud)
+    dev.identify()
+    if not dev.capabilities & loader.CAP_SET_BAUD:
+        return skip(sim, dev)
+    dev.query(loader.CMD_SET_BAUD, loader.u32(4 * sim.baud))
+
+    # the simulator passes bytes at any rate, so the noise is bytes that
+    # never start a frame, and the rate is taken from its summary
+    noise(dev, bytes([0x55]) * 16)
+    dev.start_app()
+    baud = int(sim.finish()['baud'])
+    return baud == sim.baud, 'ended at {} baud, started at {}'.format(baud, sim.baud)
+
+
+def framing_changes(path):
+    sim = loader.Simulator(path)
+    dev = loader.Device(loader.Port(sim.pty), sim.baud)
+    dev.identify()
+    if not dev.capabilities & loader.CAP_COBS:
+        return skip(sim, dev)
+    if dev.set_framing(loader.FRAMING_COBS) != loader.FRAMING_COBS:
+        dev.start_app()
+        sim.finish()
+        return False, 'the change was not confirmed'
+
+    # well past BAUD_CONFIRM_TIME, frames full of zeros still cross in COBS
+    time.sleep(NOISE_TIME)
+    try:
+        words = dev.read_max(0)
+        dev.query(loader.CMD_READ_DESCRIPTOR, retries=0)
+        result = (len(words) == dev.max_prog_size, 'answers in COBS framing')
+    except loader.ProtocolError:
+        result = (False, 'stopped answering after the change')
+    dev.start_app()
+    sim.finish()
+    return result
+
+
+def framing_falls_back(path):
+    sim = loader.Simulator(path)
+    dev = loader.Device(loader.Port(sim.pty), sim.baud)
+    dev.identify()
+    if not dev.capabilities & loader.CAP_COBS:
+        return skip(sim, dev)
+    dev.query(loader.CMD_SET_FRAMING, bytes((loader.FRAMING_COBS,)))
+
+    # a host that missed the change keeps sending escaped frames, which are
+    # never intact as COBS
+    noise(dev, loader.encode_frame(loader.CMD_READ_VERSION))
+    try:
+        dev.query(loader.CMD_READ_VERSION, retries=0)
+        result = (True, 'answers escaped frames again')
+    except loader.ProtocolError:
+        result = (False, 'still in COBS framing')
+    dev.start_app()
+    sim.process.kill()
+    sim.process.communicate()
+    return result
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('usage: test_link.py <simulator>')
+
+    failed = 0
+    for name, test in (('baud rate changes', baud_changes),
+                       ('baud rate falls back', baud_falls_back),
+                       ('framing changes', framing_changes),
+                       ('framing falls back', framing_falls_back)):
+        passed, detail = test(sys.argv[1])
+        result = 'skipped' if passed is None else 'ok' if passed else 'FAILED'
+        print('{:<24} {}  ({})'.format(name, result, detail))
+        failed += passed is False
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
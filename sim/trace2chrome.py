@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""Converts a trace saved by loader.py --trace into a Chrome trace.
+
+The trace is the CMD_READ_TRACE replies of a BOOT_TRACE build, one after
+another.  Each pair of start and end events becomes a slice on its own row:
+frames as they are decoded, the commands handled, flash operations and
+replies.  Open the output in chrome://tracing or https://ui.perfetto.dev.
+
+    ./loader.py --sim build/pic24fj256gb106-trace/bootypic-sim --synthetic 30000 \\
+        --packed --trace session.trace
+    ./trace2chrome.py session.trace -o session.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+import loader
+
+TRACE_FRAME_START = 0x01
+TRACE_FRAME_END = 0x02
+TRACE_DECODE_DONE = 0x03
+TRACE_COMMAND_END = 0x04
+TRACE_NVM_START = 0x05
+TRACE_NVM_END = 0x06
+TRACE_TX_START = 0x07
+TRACE_TX_END = 0x08
+
+HEADER = '<IHH'
+RECORD = '<IHB'
+
+# the row of each slice, and the events that start and end it
+ROWS = {
+    'receive': (1, TRACE_FRAME_START, TRACE_FRAME_END),
+    'command': (2, TRACE_DECODE_DONE, TRACE_COMMAND_END),
+    'flash': (3, TRACE_NVM_START, TRACE_NVM_END),
+    'transmit': (4, TRACE_TX_START, TRACE_TX_END),
+}
+
+COMMANDS = {value: name for name, value in vars(loader).items() if name.startswith('CMD_')}
+
+
+def read_records(data):
+    """Returns (fcy, lost, [(cycles, event, arg)]) from the saved replies,
+    with the 32-bit timer unwrapped."""
+    records, lost, fcy = [], 0, 1
+    offset, base, last = 0, 0, None
+    while offset < len(data):
+        fcy, dropped, count = struct.unpack_from(HEADER, data, offset)
+        offset += struct.calcsize(HEADER)
+        lost += dropped
+        for _ in range(count):
+            time, arg, event = struct.unpack_from(RECORD, data, offset)
+            offset += struct.calcsize(RECORD)
+            if last is not None and time < last:
+                base += 1 << 32
+            last = time
+            records.append((base + time, event, arg))
+    return fcy, lost, records
+
+
+def slice_name(row, arg):
+    if row == 'command':
+        name = COMMANDS.get(arg & 0xff, '0x{:02x}'.format(arg & 0xff))
+        return name if not arg >> 8 else '{} (status {})'.format(name, arg >> 8)
+    if row == 'flash':
+        return loader.STATS_NVM[arg] if arg < len(loader.STATS_NVM) else str(arg)
+    if row == 'receive':
+        return 'frame'
+    return 'reply'
+
+
+def convert(fcy, records):
+    events = []
+    for row, (tid, _, _) in ROWS.items():
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': 1, 'tid': tid,
+                       'args': {'name': row}})
+
+    starts = {row: start for row, (_, start, _) in ROWS.items()}
+    ends = {row: end for row, (_, _, end) in ROWS.items()}
+    open_slices = {}
+    first = records[0][0] if records else 0
+    for cycles, event, arg in records:
+        us = (cycles - first) * 1e6 / fcy
+        for row, (tid, _, _) in ROWS.items():
+            if event == starts[row]:
+                # a start without an end, such as a frame cut short by
+                # another start byte, is closed where the next one begins
+                if row in open_slices:
+                    events.append({'ph': 'E', 'pid': 1, 'tid': tid, 'ts': us})
+                open_slices[row] = True
+                events.append({'name': slice_name(row, arg), 'ph': 'B', 'pid': 1,
+                               'tid': tid, 'ts': us})
+            elif event == ends[row] and open_slices.pop(row, False):
+                events.append({'ph': 'E', 'pid': 1, 'tid': tid, 'ts': us,
+                               'args': {'arg': arg}})
+    return events
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('trace', help='trace saved by loader.py --trace')
+    parser.add_argument('-o', '--output', help='Chrome trace to write (default: stdout)')
+    args = parser.parse_args()
+
+    with open(args.trace, 'rb') as trace:
+        fcy, lost, records = read_records(trace.read())
+    events = convert(fcy, records)
+    text = json.dumps({'traceEvents': events, 'displayTimeUnit': 'ms'})
+    if args.output:
+        with open(args.output, 'w') as output:
+            output.write(text)
+    else:
+        print(text)
+
+    span = (records[-1][0] - records[0][0]) / fcy if records else 0
+    print('{} events over {:.3f}s, {} lost'.format(len(records), span, lost),
+          file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
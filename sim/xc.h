@@ -0,0 +1,146 @@
+#ifndef _SIM_XC_H
+#define _SIM_XC_H
+
+/* Host stand-in for the XC16 device header.  Only the device parameters and
+ * special function registers that the bootloader touches are provided.  Each
+ * register access is routed through the simulator so that it can advance the
+ * virtual instruction clock and update the peripheral models. */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* device parameters normally supplied by the XC16 device header */
+#if defined(__dsPIC33EP32MC204__)
+#define __dsPIC33E__
+#define _FLASH_PAGE         512
+#define _FLASH_ROW          64
+#define __PROGRAM_LENGTH    0x5800
+#elif defined(__dsPIC33EP64MC504__)
+#define __dsPIC33E__
+#define _FLASH_PAGE         1024
+#define _FLASH_ROW          128
+#define __PROGRAM_LENGTH    0xB000
+#elif defined(__PIC24FJ256GB106__)
+#define __PIC24F__
+#define _FLASH_PAGE         512
+#define _FLASH_ROW          64
+#define __PROGRAM_LENGTH    0x2AC00
+#elif defined(__PIC24FV16KM202__)
+#define __PIC24F__
+#define __PROGRAM_LENGTH    0x2C00
+#else
+#error "device not supported by the simulator"
+#endif
+
+#define __IVT_BASE          0x4
+
+typedef struct {
+    unsigned URXDA:1;
+    unsigned OERR:1;
+    unsigned FERR:1;
+    unsigned PERR:1;
+    unsigned RIDLE:1;
+    unsigned ADDEN:1;
+    unsigned URXISEL:2;
+    unsigned TRMT:1;
+    unsigned UTXBF:1;
+    unsigned UTXEN:1;
+    unsigned UTXBRK:1;
+    unsigned :1;
+    unsigned UTXISEL0:1;
+    unsigned UTXINV:1;
+    unsigned UTXISEL1:1;
+} U1STABITS;
+
+typedef struct {
+    unsigned STSEL:1;
+    unsigned PDSEL:2;
+    unsigned BRGH:1;
+    unsigned URXINV:1;
+    unsigned ABAUD:1;
+    unsigned LPBACK:1;
+    unsigned WAKE:1;
+    unsigned UEN:2;
+    unsigned :1;
+    unsigned RTSMD:1;
+    unsigned IREN:1;
+    unsigned USIDL:1;
+    unsigned :1;
+    unsigned UARTEN:1;
+} U1MODEBITS;
+
+typedef struct {
+    unsigned :1;
+    unsigned TCS:1;
+    unsigned TSYNC:1;
+    unsigned :1;
+    unsigned TCKPS:2;
+    unsigned :1;
+    unsigned TGATE:1;
+    unsigned :5;
+    unsigned TSIDL:1;
+    unsigned :1;
+    unsigned TON:1;
+} TxCONBITS;
+
+typedef struct {
+    unsigned :14;
+    unsigned WREN:1;
+    unsigned WR:1;
+} NVMCONBITS;
+
+typedef struct {
+    unsigned :11;
+    unsigned U1RXIF:1;
+    unsigned :4;
+} IFS0BITS;
+
+typedef struct {
+    unsigned :11;
+    unsigned U1RXIE:1;
+    unsigned :4;
+} IEC0BITS;
+
+typedef struct {
+    unsigned :15;
+    unsigned ALTIVT:1;
+} INTCON2BITS;
+
+U1STABITS* simU1sta(void);
+uint16_t simU1rxreg(void);
+volatile uint16_t* simU1txreg(void);
+volatile uint16_t* simTmr(uint16_t timer);
+TxCONBITS* simTxcon(uint16_t timer);
+NVMCONBITS* simNvmcon(void);
+IFS0BITS* simIfs0(void);
+IEC0BITS* simIec0(void);
+INTCON2BITS* simIntcon2(void);
+void simClrWdt(void);
+
+extern U1MODEBITS U1MODEbits;
+extern volatile uint16_t U1BRG;
+
+#define U1STAbits   (*simU1sta())
+#define U1RXREG     (simU1rxreg())
+#define U1TXREG     (*simU1txreg())
+#define TMR1        (*simTmr(1))
+#if defined(__PIC24FV16KM202__)
+/* the port runs CCP1 as its timer and names it TMR2 */
+#define CCP1TMRL    (*simTmr(2))
+#else
+#define TMR2        (*simTmr(2))
+#endif
+#define T1CONbits   (*simTxcon(1))
+#define T2CONbits   (*simTxcon(2))
+
+#define NVMCONbits  (*simNvmcon())
+#define IFS0bits    (*simIfs0())
+#define IEC0bits    (*simIec0())
+#define INTCON2bits (*simIntcon2())
+
+/* the simulator calls the U1RX handler as a plain function */
+#define RX_ISR
+
+#define ClrWdt()    simClrWdt()
+
+#endif